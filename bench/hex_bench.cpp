@@ -0,0 +1,156 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+/*
+ * Compares the hex kernels in encdec.cpp on the sizes the pool sees: 4 byte job ids and
+ * targets, 32 byte seeds and results, and job blobs. Every kernel is checked against the
+ * scalar one first. Built with -DBUILD_BENCHMARKS=ON, it is not part of epic_poold.
+ */
+
+#include "../encdec.h"
+#include "../encdec_simd.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+
+typedef bool (*dec_fn)(const char*, unsigned int, unsigned char*);
+typedef void (*enc_fn)(const unsigned char*, unsigned int, char*);
+
+struct kernel
+{
+	const char* name;
+	enc_fn enc;
+	dec_fn dec;
+	bool supported;
+};
+
+static constexpr unsigned int max_len = 1024;
+static unsigned char bin[max_len];
+static unsigned char bin_out[max_len];
+static char hex[max_len * 2 + 1];
+static char hex_ref[max_len * 2 + 1];
+static volatile unsigned int sink;
+
+static bool verify(const kernel& k)
+{
+	for(unsigned int len = 0; len <= max_len; len++)
+	{
+		bin2hex_scalar(bin, len, hex_ref);
+		k.enc(bin, len, hex);
+		if(memcmp(hex, hex_ref, len * 2 + 1) != 0)
+		{
+			printf("%s: encode mismatch at len %u\n", k.name, len);
+			return false;
+		}
+
+		// Mixed case must decode, and a bad character in any position must be caught
+		for(unsigned int i = 0; i < len * 2; i += 3)
+			hex[i] = hex[i] >= 'a' ? hex[i] - 0x20 : hex[i];
+		if(!k.dec(hex, len * 2, bin_out) || memcmp(bin, bin_out, len) != 0)
+		{
+			printf("%s: decode mismatch at len %u\n", k.name, len);
+			return false;
+		}
+
+		for(unsigned int i = 0; i < len * 2; i += 7)
+		{
+			const char bad[] = { 'g', 'G', '/', ':', '@', '`', ' ', '\0', char(0xb0) };
+			char c = hex[i];
+			hex[i] = bad[i % sizeof(bad)];
+			bool res = k.dec(hex, len * 2, bin_out);
+			hex[i] = c;
+			if(res)
+			{
+				printf("%s: accepted a bad character at %u, len %u\n", k.name, i, len);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void run(const kernel& k, unsigned int len)
+{
+	const unsigned int iters = 20000000 / (len + 16);
+	bin2hex_scalar(bin, len, hex);
+
+	auto t0 = std::chrono::steady_clock::now();
+	for(unsigned int i = 0; i < iters; i++)
+	{
+		k.enc(bin, len, hex);
+		sink += hex[i % (len * 2)];
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	for(unsigned int i = 0; i < iters; i++)
+	{
+		sink += k.dec(hex, len * 2, bin_out);
+		sink += bin_out[i % len];
+	}
+	auto t2 = std::chrono::steady_clock::now();
+
+	double enc_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / iters;
+	double dec_ns = std::chrono::duration<double, std::nano>(t2 - t1).count() / iters;
+	printf("%-8s %6u bytes  encode %8.1f ns %6.2f GB/s  decode %8.1f ns %6.2f GB/s\n", k.name, len,
+		enc_ns, len / enc_ns, dec_ns, len / dec_ns);
+}
+
+int main()
+{
+	const kernel kernels[] = {
+		{ "scalar", bin2hex_scalar, hex2bin_scalar, true },
+		{ "ssse3", bin2hex_ssse3, hex2bin_ssse3, hex_have_ssse3() },
+		{ "avx2", bin2hex_avx2, hex2bin_avx2, hex_have_avx2() }
+	};
+	const unsigned int sizes[] = { 4, 32, 112, 192, 384, 1024 };
+
+	std::mt19937 rng(0x5eed);
+	for(unsigned int i = 0; i < max_len; i++)
+		bin[i] = rng();
+
+	for(const kernel& k : kernels)
+	{
+		if(!k.supported)
+		{
+			printf("%s: not supported on this CPU\n", k.name);
+			continue;
+		}
+		if(!verify(k))
+			return 1;
+	}
+
+	for(unsigned int len : sizes)
+	{
+		for(const kernel& k : kernels)
+		{
+			if(k.supported)
+				run(k, len);
+		}
+	}
+	return 0;
+}
@@ -28,14 +28,92 @@
 
 #pragma once
 
+#include <errno.h>
 #include <inttypes.h>
-#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include "vector32.h"
+#include "workstruct.hpp"
+
+struct check_job;
+
+/*
+ * Hash threads post finished jobs here. The owning client_pool has efd in its epoll set
+ * and drains the queue from its own thread, so nobody waits on a hash.
+ */
+class check_done_queue
+{
+public:
+	check_done_queue() : pending(0)
+	{
+		if((efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+			throw std::runtime_error("Limit of files / eventfd reached.");
+	}
+
+	~check_done_queue()
+	{
+		close(efd);
+	}
+
+	check_done_queue(const check_done_queue& r) = delete;
+	check_done_queue& operator=(const check_done_queue& r) = delete;
+
+	void push(check_job* job)
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		done_.push_back(job);
+		mlock.unlock();
+
+		uint64_t v = 1;
+		if(write(efd, &v, sizeof(v)) != sizeof(v))
+			throw std::runtime_error("Writing to eventfd failed!");
+	}
+
+	void pop_all(std::vector<check_job*>& out)
+	{
+		uint64_t v;
+		out.clear();
+		if(read(efd, &v, sizeof(v)) != sizeof(v) && errno != EAGAIN)
+			throw std::runtime_error("Reading eventfd failed!");
+
+		std::unique_lock<std::mutex> mlock(mutex_);
+		done_.swap(out);
+	}
+
+	inline int get_fd() const { return efd; }
+
+	// Jobs pushed to a hashpool and not drained yet. Only touched by the pool thread.
+	size_t pending;
+
+private:
+	int efd;
+	std::vector<check_job*> done_;
+	std::mutex mutex_;
+};
 
 struct check_job
 {
+	pow_type type;
+	uint64_t dataset_id; // RandomX seed id or ProgPoW epoch
+	size_t dataset_slot; // Referenced by verify_pool::push_job, released after hashing
 	const uint8_t* data;
 	size_t data_len;
+	uint64_t nonce; // ProgPoW only, RandomX nonce is inside data
+	uint64_t block_number; // ProgPoW only
+	v32 header_hash; // ProgPoW only, filled in by the hash thread if has_header_hash is false
+	bool has_header_hash;
 	v32 hash;
 	bool error;
+
+	bool priority; // Claims to solve a block, verified ahead of everything else
+	uint64_t queued_us;
+	void (*on_verified)(check_job* job); // Optional, runs on the hash thread before completion
+
+	check_done_queue* done_q;
+	void* owner; // opaque to the hash threads, used by done_q owner to route the result
+
+	inline void complete() { done_q->push(this); }
 };
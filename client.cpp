@@ -31,19 +31,29 @@
 #include "encdec.h"
 
 #include "pp_hashpool.hpp"
-#include "rx_hashpool.hpp"
+#include "stats.hpp"
+#include "stratum_parser.hpp"
+#include "verify_pool.hpp"
+
+#include <algorithm>
 
 constexpr uint32_t fix_diff = 4096;
 
-const client::method_idx client::call_tab[] =
+/* Slot is method_hash of the name, a new method needs a free one */
+const client::method_idx client::call_tab[client::call_tab_size] =
 {
-	{"submit", &client::process_method_submit},
-	{"login", &client::process_method_login},
-	{"keepalived", &client::process_method_keepalive},
-	{nullptr, nullptr}
+	{nullptr, 0, nullptr},
+	{nullptr, 0, nullptr},
+	{"keepalived", 10, &client::process_method_keepalive},
+	{nullptr, 0, nullptr},
+	{nullptr, 0, nullptr},
+	{"login", 5, &client::process_method_login},
+	{"submit", 6, &client::process_method_submit},
+	{nullptr, 0, nullptr}
 };
 
 size_t client::max_calls_per_min = 0;
+size_t client::send_hwm = 0;
 size_t client::bad_share_ban_cnt = 0;
 uint32_t client::srv_start_diff = client::min_diff;
 uint32_t client::srv_const_diff = 0;
@@ -54,38 +64,206 @@ size_t client::client_timeouts[3] = {0};
 
 std::atomic<uint32_t> g_extra_nonce_ctr(0);
 
-client::client(SOCKET fd, const in6_addr& ip_addr, in_port_t port) : 
-	fd(fd), active_time(get_timestamp()), domAlloc(json_dom_buf, json_buf_size), 
-	parseAlloc(json_parse_buf, json_buf_size), jsonDoc(&domAlloc, json_buf_size, &parseAlloc)
+client::thd_state::~thd_state()
 {
-	char str[64];
-	ip_addr_str[0] = '\0';
-	
-	if(inet_ntop(AF_INET6, &ip_addr, str, sizeof(str)) == nullptr)
-		throw std::runtime_error("inet_ntop failed!");
-	
-	snprintf(ip_addr_str, sizeof(ip_addr_str), "[%s]:%u", str, ntohs(port));
+	for(sock_buffer* buf : spare_bufs)
+		delete buf;
+}
+
+sock_buffer* client::thd_state::take_buf()
+{
+	if(spare_bufs.empty())
+		return new sock_buffer;
 
+	sock_buffer* buf = spare_bufs.back();
+	spare_bufs.pop_back();
+	return buf;
+}
+
+void client::thd_state::return_buf(sock_buffer* buf)
+{
+	if(spare_bufs.size() >= max_spare_bufs)
+	{
+		delete buf;
+		return;
+	}
+
+	buf->len = 0;
+	spare_bufs.push_back(buf);
+}
+
+client::client(SOCKET fd, const in6_addr& ip_addr, in_port_t port, check_done_queue& check_q, thd_state& st, uint32_t pool_idx, uint64_t gen) : 
+	fd(fd), check_q(check_q), st(st), pool_idx(pool_idx), gen(gen), ip_addr(ip_addr), port(port), active_time(get_timestamp())
+{
 	extra_nonce = g_extra_nonce_ctr.fetch_add(1);
 }
 
+void client::get_job_blob(uint8_t* blob)
+{
+	memcpy(blob, cur_job->prepow, cur_job->prepow_len);
+	memcpy(blob + cur_job->prepow_len - sizeof(uint32_t)*2, &extra_nonce, sizeof(uint32_t));
+}
+
+void client::net_send(sock_buffer& out)
+{
+	stats::inst().net_replies.inc();
+	if(corked)
+	{
+		sock_buffer& cb = get_thd_state().cork_buf;
+		if(out.len > cb.len_rem())
+		{
+			send_data(cb.buf, cb.len);
+			cb.len = 0;
+		}
+
+		memcpy(cb.pos(), out.buf, out.len);
+		cb.len += out.len;
+	}
+	else
+		send_data(out.buf, out.len);
+	out.len = 0;
+}
+
+bool client::uncork()
+{
+	sock_buffer& cb = get_thd_state().cork_buf;
+	corked = false;
+	if(cb.len > 0)
+		send_data(cb.buf, cb.len);
+	cb.len = 0;
+	return !aborting;
+}
+
+void client::send_data(const char* data, size_t len)
+{
+	if(aborting)
+		return;
+
+	/* Replies must not overtake what is already queued */
+	if(send_q.empty())
+	{
+		stats::inst().net_writes.inc();
+		ssize_t ret = write(fd, data, len);
+		if(ret == -1)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				hard_abort();
+				return;
+			}
+			ret = 0;
+		}
+
+		if(size_t(ret) == len)
+			return;
+		data += ret;
+		len -= ret;
+	}
+
+	queue_send(data, len);
+}
+
+void client::queue_send(const char* data, size_t len)
+{
+	if(send_q_bytes + len > send_hwm)
+	{
+		logger::inst().dbghi("Dropping client ", pool_idx, ", ", send_q_bytes + len, " bytes unsent");
+		stats::inst().send_hwm_drops.inc();
+		release_send_q();
+		hard_abort();
+		return;
+	}
+
+	thd_state& st = get_thd_state();
+	send_q_bytes += len;
+	while(len > 0)
+	{
+		if(send_q.empty() || send_q.back()->len_rem() == 0)
+			send_q.push_back(st.take_buf());
+
+		sock_buffer* buf = send_q.back();
+		size_t cnt = std::min(len, buf->len_rem());
+		memcpy(buf->pos(), data, cnt);
+		buf->len += cnt;
+		data += cnt;
+		len -= cnt;
+	}
+}
+
+void client::release_send_q()
+{
+	if(send_q.empty())
+		return;
+
+	thd_state& st = get_thd_state();
+	for(sock_buffer* buf : send_q)
+		st.return_buf(buf);
+	send_q.clear();
+	send_q.shrink_to_fit();
+	send_q_off = 0;
+	send_q_bytes = 0;
+}
+
+bool client::on_socket_write()
+{
+	if(aborting)
+		return false;
+
+	while(!send_q.empty())
+	{
+		sock_buffer* buf = send_q.front();
+		stats::inst().net_writes.inc();
+		ssize_t ret = write(fd, buf->buf + send_q_off, buf->len - send_q_off);
+		if(ret == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+
+		send_q_off += ret;
+		send_q_bytes -= ret;
+		if(send_q_off < buf->len)
+			return true; // Socket is full again, wait for the next EPOLLOUT
+
+		send_q_off = 0;
+		get_thd_state().return_buf(buf);
+		send_q.erase(send_q.begin());
+	}
+
+	/* Congestion is over, don't keep the queue around */
+	send_q.shrink_to_fit();
+	return true;
+}
+
+/* Replies to all requests of one read pass go out with a single write */
 bool client::on_socket_read()
+{
+	cork();
+	bool keep = read_lines();
+	uncork();
+	return keep && !aborting;
+}
+
+bool client::read_lines()
 {
 	while(true)
 	{
 		int ret = net_recv();
 		if(ret <= 0)
-			return !(ret == 0);
+		{
+			/* Idle clients don't keep a buffer */
+			if(recv_buf != nullptr && recv_buf->len == 0)
+				release_recv_buf();
+			/* A reply may have aborted us, net_recv then reports no data */
+			return ret != 0 && !aborting;
+		}
 
-		if(recv_buf.len >= sock_buffer::sock_buf_size)
+		if(recv_buf->len >= sock_buffer::sock_buf_size)
 		{
 			hard_abort();
 			return false; // Exit due to buffer overflow
 		}
 		
 		char* lnend;
-		char* lnstart = recv_buf.buf;
-		while((lnend = (char*)memchr(lnstart, '\n', recv_buf.len)) != nullptr)
+		char* lnstart = recv_buf->buf;
+		while((lnend = (char*)memchr(lnstart, '\n', recv_buf->len)) != nullptr)
 		{
 			lnend++;
 			int lnlen = lnend - lnstart;
@@ -96,42 +274,29 @@ bool client::on_socket_read()
 				return false; // Exit due to parsing error
 			}
 			
-			recv_buf.len -= lnlen;
+			recv_buf->len -= lnlen;
 			lnstart = lnend;
 		}
 		
 		//Got leftover data? Move it to the front
-		if(recv_buf.len > 0 && recv_buf.buf != lnstart)
-			memmove(recv_buf.buf, lnstart, recv_buf.len);
+		if(recv_buf->len > 0 && recv_buf->buf != lnstart)
+			memmove(recv_buf->buf, lnstart, recv_buf->len);
 	}
 }
 
 bool client::process_line(char* buf, int len)
 {
-	int64_t call_id = 0;
-	
 	if(len <= 0)
 		return false;
 	
-	clear_json_bufs();
-	
 	buf[len - 1] = '\0';
-	if(jsonDoc.ParseInsitu(buf).HasParseError())
-		return false;
-	
-	if(!jsonDoc.IsObject())
+	stratum_request req;
+	if(!parse_stratum_request(buf, req))
 		return false;
 	
-	lpcJsVal cid = GetObjectMember(jsonDoc, "id");
-	if(cid != nullptr && cid->IsInt64())
-		call_id = cid->GetInt64();
-	
-	lpcJsVal method = GetObjectMember(jsonDoc, "method");
-	lpcJsVal args = GetObjectMember(jsonDoc, "params");
-	
-	if(method == nullptr || args == nullptr || !method->IsString() || !args->IsObject())
+	if(req.method.str == nullptr || !req.has_params)
 	{
-		send_error_response(call_id, "Malformed request");
+		send_error_response(req.call_id, "Malformed request");
 		return true;
 	}
 	
@@ -146,105 +311,117 @@ bool client::process_line(char* buf, int len)
 	
 	if(flood_count > max_calls_per_min)
 	{
-		send_error_response(call_id, "Slow down");
+		send_error_response(req.call_id, "Slow down");
 		return true;
 	}
 	
-	size_t i = 0;
-	const char* s_method = method->GetString();
-	while(call_tab[i].method != nullptr)
+	const method_idx& m = call_tab[method_hash(req.method.len)];
+	if(m.method != nullptr && m.len == req.method.len && strncasecmp(m.method, req.method.str, m.len) == 0)
 	{
-		if(strcasecmp(call_tab[i].method, s_method) == 0)
-		{
-			(this->*call_tab[i].call)(call_id, *args);
-			return true;
-		}
-		i++;
+		(this->*m.call)(req);
+		return true;
 	}
 	
-	send_error_response(call_id, "Unknown method");
+	send_error_response(req.call_id, "Unknown method");
 	return true;
 }
 
 void client::send_error_response(int64_t call_id, const char* msg)
 {
-	send_buf.len = snprintf(send_buf.buf, sizeof(send_buf.buf), 
+	sock_buffer& out = get_thd_state().send_buf;
+	out.len = snprintf(out.buf, sizeof(out.buf), 
 			"{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":{\"code\":-1,\"message\":\"%s\"}}\n", (long long int)call_id, msg);
-	net_send();
+	net_send(out);
+}
+
+void client::build_job_template(jobdata& job)
+{
+	job_template& t = job.notify;
+	char hex_blob[sizeof(job.prepow) * 2 + 1];
+	char seed_hash[65];
+	bin2hex(job.prepow, job.prepow_len, hex_blob);
+	bin2hex(job.rx_seed.data, job.rx_seed.size, seed_hash);
+
+	/* Extra nonce sits in the zeroed 8 bytes the node appended to the blob */
+	int head = snprintf(t.msg, sizeof(t.msg), "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"");
+	t.params_off = head - strlen("{\"blob\":\"");
+	t.extra_nonce_off = head + (job.prepow_len - sizeof(uint32_t)*2) * 2;
+	t.jobid_off = head + strlen(hex_blob) + strlen("\",\"job_id\":\"");
+	t.target_off = t.jobid_off + strlen("00000000\",\"target\":\"");
+
+	int len = snprintf(t.msg, sizeof(t.msg), "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":"
+		"{\"blob\":\"%s\",\"job_id\":\"00000000\",\"target\":\"00000000\",\"pow_algo\":\"%s\",\"seed_hash\":\"%s\",\"height\":%u}}\n",
+		hex_blob, pow_type_to_str(job.type), seed_hash, job.height);
+	t.len = len;
+	t.params_len = len - t.params_off - strlen("}\n");
+}
+
+inline void patch_hex32(char* out, uint32_t v)
+{
+	char hex[9];
+	bin2hex((const unsigned char*)&v, sizeof(uint32_t), hex);
+	memcpy(out, hex, 8);
 }
 
-void client::process_method_login(int64_t call_id, const Value& args)
+void client::patch_job_template(char* base, size_t base_off)
+{
+	const job_template& t = cur_job->notify;
+	patch_hex32(base + t.extra_nonce_off - base_off, extra_nonce);
+	patch_hex32(base + t.jobid_off - base_off, jobid);
+	patch_hex32(base + t.target_off - base_off, diff_to_target(fix_diff));
+}
+
+void client::process_method_login(const stratum_request& req)
 {
 	if(logged_in)
 	{
-		send_error_response(call_id, "You are logged in.");
+		send_error_response(req.call_id, "You are logged in.");
 		return;
 	}
 
-	GetObjectMember(args, "pass");
-	GetObjectMember(args, "login");
-
 	my_id.uid = 1;
 	my_id.miner = 0;
 	my_id.rid = 0;
 
 	get_new_job();
 
-	char hex_jobid[9];
-	char hex_target[9];
-	char hex_blob[768];
-	const char* pow_type = pow_type_to_str(cur_job.type);
+	const job_template& t = cur_job->notify;
+	sock_buffer& out = get_thd_state().send_buf;
+	out.len = snprintf(out.buf, sizeof(out.buf), "{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":"
+		"{\"id\":\"decafbad0\",\"job\":", (long long int)req.call_id);
+	memcpy(out.pos(), t.msg + t.params_off, t.params_len);
+	patch_job_template(out.pos(), t.params_off);
+	out.len += t.params_len;
+	out.len += snprintf(out.pos(), out.len_rem(), ",\"status\":\"OK\"}}\n");
 
-	memcpy(cur_job.prepow + cur_job.prepow_len - sizeof(uint32_t)*2, &extra_nonce, sizeof(uint32_t));
-
-	bin2hex(cur_job.prepow, cur_job.prepow_len, hex_blob);
-	bin2hex((const unsigned char*)&jobid, sizeof(uint32_t), hex_jobid);
- 	uint32_t t = diff_to_target(fix_diff);
-	bin2hex((const unsigned char*)&t, sizeof(uint32_t), hex_target);
-
-	char seed_hash[65];
-	bin2hex(cur_job.rx_seed.data, cur_job.rx_seed.size, seed_hash);
-	send_buf.len = snprintf(send_buf.buf, sizeof(send_buf.buf), "{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":"
-		"{\"id\":\"decafbad0\",\"job\":"
-		"{\"blob\":\"%s\",\"job_id\":\"%s\",\"target\":\"%s\",\"pow_algo\":\"%s\",\"seed_hash\":\"%s\",\"height\":%u},"
-		"\"status\":\"OK\"}}\n",
-		(long long int)call_id, hex_blob, hex_jobid, hex_target, pow_type, seed_hash, cur_job.height);
-
-	net_send();
+	net_send(out);
 	logged_in = true;
 }
 
-void client::process_method_submit(int64_t call_id, const Value& args)
+void client::process_method_submit(const stratum_request& req)
 {
-	lpcJsVal s_jobid, s_nonce, s_result, s_hashcnt;
-	s_jobid = GetObjectMember(args, "job_id");
-	s_nonce = GetObjectMember(args, "nonce");
-	s_result = GetObjectMember(args, "result");
-	s_hashcnt = GetObjectMember(args, "hashcount_total");
-
-	if(s_jobid == nullptr || s_nonce == nullptr || s_result == nullptr ||
-		!s_jobid->IsString() || !s_nonce->IsString() || !s_result->IsString() ||
-		s_jobid->GetStringLength() != 8 || s_nonce->GetStringLength() != 8 || s_result->GetStringLength() != 64)
+	int64_t call_id = req.call_id;
+	if(req.job_id.len != 8 || req.nonce.len != 8 || req.result.len != 64)
 	{
 		send_error_response(call_id, "Malformed submit");
 		return;
 	}
 
 	uint32_t net_jobid, nonce;
-	if(!hex2bin(s_jobid->GetString(), 8, (unsigned char*)&net_jobid))
+	if(!hex2bin(req.job_id.str, 8, (unsigned char*)&net_jobid))
 	{
 		send_error_response(call_id, "Invalid jobid");
 		return;
 	}
 
-	if(!hex2bin(s_nonce->GetString(), 8, (unsigned char*)&nonce))
+	if(!hex2bin(req.nonce.str, 8, (unsigned char*)&nonce))
 	{
 		send_error_response(call_id, "Invalid nonce");
 		return;
 	}
 
-	uint64_t claim_work;
-	if(!hex2bin(s_result->GetString() + 48, 16, (unsigned char*)&claim_work))
+	v32 claim_hash;
+	if(!hex2bin(req.result.str, 64, claim_hash.data))
 	{
 		send_error_response(call_id, "Invalid result");
 		return;
@@ -256,86 +433,167 @@ void client::process_method_submit(int64_t call_id, const Value& args)
 		return;
 	}
 
-	check_job job = check_client_work(nonce);
-
-	if(job.error)
+	if(inflight_checks >= max_inflight_checks)
 	{
-		send_error_response(call_id, "Server error while checking share.");
+		send_error_response(call_id, "Slow down");
 		return;
 	}
 
-	uint32_t target = 0xFFFFFFFFU / fix_diff;
-	if(job.hash.get_work32() > target)
+	if(!cur_job->shares->insert((uint64_t(extra_nonce) << 32) | nonce))
 	{
-		send_error_response(call_id, "Bad share");
+		stats::inst().dup_shares.inc();
+		send_error_response(call_id, "Duplicate share");
 		return;
 	}
 
+	/* Miner says it found a block, don't let it queue behind ordinary shares unless its claims keep failing */
+	bool priority = false_claims < max_false_claims && work_to_diff(claim_hash.get_work64()) >= cur_job->block_diff;
+
+	if(!check_client_work(call_id, nonce, priority))
+	{
+		/* Never checked, so a retry of the same nonce must not count as a duplicate */
+		cur_job->shares->erase((uint64_t(extra_nonce) << 32) | nonce);
+		send_error_response(call_id, "Server error while checking share.");
+	}
+}
+
+void client::submit_block(share_check& chk)
+{
+	const check_job& job = chk.chk;
+	if(chk.block_submitted || job.error)
+		return;
+
 	uint64_t actual_diff = work_to_diff(job.hash.get_work64());
 	
-	if(actual_diff > 4096)//cur_job.block_diff)
+	if(actual_diff >= chk.job->block_diff)
 	{
-		uint64_t full_nonce = __builtin_bswap64((uint64_t(nonce) << 32ull) | extra_nonce);
+		uint64_t full_nonce = __builtin_bswap64((uint64_t(chk.nonce) << 32ull) | chk.extra_nonce);
 		logger::inst().info("Block submit: ", actual_diff);
-		node::inst().send_job_result(cur_job, full_nonce, job.hash);
+		node::inst().send_job_result(*chk.job, full_nonce, job.hash);
 	}
 
-	send_buf.len = snprintf(send_buf.buf, sizeof(send_buf.buf),
-		"{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n", (long long int)call_id);
-	net_send();
+	chk.block_submitted = true;
 }
 
-void client::process_method_keepalive(int64_t call_id, const Value& args)
+/* Runs on the hash thread for priority jobs, the block goes out the moment it is verified */
+void client::on_block_candidate(check_job* job)
 {
-	send_buf.len = snprintf(send_buf.buf, sizeof(send_buf.buf),
-		"{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n", (long long int)call_id);
-	net_send();
+	submit_block(*static_cast<share_check*>(job->owner));
 }
 
-check_job client::check_client_work(uint32_t nonce)
+bool client::on_check_done(share_check& chk)
 {
-	std::future<void> future;
-	switch(cur_job.type)
+	inflight_checks--;
+	if(aborting)
+		return false;
+
+	const check_job& job = chk.chk;
+	/* Only the current pair is worth keeping, a late share for an older job must not replace it */
+	if(job.type == pow_type::progpow && job.has_header_hash && chk.cli_jobid == jobid && chk.extra_nonce == extra_nonce &&
+		!pp_header.matches(jobid, extra_nonce))
 	{
-		case pow_type::randomx:
-		{
-			memcpy(cur_job.prepow + cur_job.prepow_len - sizeof(uint32_t), &nonce, sizeof(uint32_t));
+		pp_header.jobid = chk.cli_jobid;
+		pp_header.extra_nonce = chk.extra_nonce;
+		pp_header.hash = job.header_hash;
+		pp_header.valid = true;
+	}
+
+	if(job.error)
+	{
+		send_error_response(chk.call_id, "Server error while checking share.");
+		return !aborting;
+	}
 
-			rx_hashpool::rx_check_job job;
-			job.data = cur_job.prepow;
-			job.data_len = cur_job.prepow_len;
-			job.dataset_id = cur_job.rx_seed.get_id();
-			future = job.ready.get_future();
+	if(job.priority && work_to_diff(job.hash.get_work64()) < chk.job->block_diff)
+	{
+		stats::inst().false_block_claims.inc();
+		if(++false_claims == max_false_claims)
+			logger::inst().info("Client ", pool_idx, " moved off the priority lane, ", max_false_claims, " block claims didn't verify");
+	}
 
-			rx_hashpool::inst().push_job(job);
-			future.wait();
-			return std::move(job);
-		}
-		case pow_type::progpow:
-		{
-			uint64_t total_nonce = extra_nonce;
-			total_nonce <<= 32;
-			total_nonce |= nonce;
-
-			pp_hashpool::pp_check_job job;
-			job.data = cur_job.prepow;
-			job.data_len = cur_job.prepow_len - sizeof(uint64_t);
-			job.block_number = cur_job.height;
-			job.nonce = total_nonce;
-			future = job.ready.get_future();
-
-			pp_hashpool::inst().push_job(job);
-			future.wait();
-			return std::move(job);
-		}
-		default:
-		{
-			check_job job;
-			job.error = true;
-			job.hash.set_all_ones();
-			return job;
-		}
+	uint32_t target = 0xFFFFFFFFU / fix_diff;
+	if(job.hash.get_work32() > target)
+	{
+		send_error_response(chk.call_id, "Bad share");
+		return !aborting;
+	}
+
+	submit_block(chk);
+
+	sock_buffer& out = get_thd_state().send_buf;
+	out.len = snprintf(out.buf, sizeof(out.buf),
+		"{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n", (long long int)chk.call_id);
+	net_send(out);
+	return !aborting;
+}
+
+void client::process_method_keepalive(const stratum_request& req)
+{
+	sock_buffer& out = get_thd_state().send_buf;
+	out.len = snprintf(out.buf, sizeof(out.buf),
+		"{\"id\":%lld,\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n", (long long int)req.call_id);
+	net_send(out);
+}
+
+bool client::check_client_work(int64_t call_id, uint32_t nonce, bool priority)
+{
+	if(cur_job->type != pow_type::randomx && cur_job->type != pow_type::progpow)
+		return false;
+
+	share_check* chk = new share_check();
+	chk->cli_idx = pool_idx;
+	chk->cli_gen = gen;
+	chk->call_id = call_id;
+	chk->nonce = nonce;
+	chk->cli_jobid = jobid;
+	chk->extra_nonce = extra_nonce;
+	chk->block_submitted = false;
+	chk->job = cur_job;
+	get_job_blob(chk->blob);
+
+	const jobdata& job = *cur_job;
+	check_job& cj = chk->chk;
+	cj.type = job.type;
+	cj.priority = priority;
+	cj.on_verified = priority ? &client::on_block_candidate : nullptr;
+	cj.done_q = &check_q;
+	cj.owner = chk;
+
+	if(job.type == pow_type::randomx)
+	{
+		memcpy(chk->blob + job.prepow_len - sizeof(uint32_t), &nonce, sizeof(uint32_t));
+
+		cj.dataset_id = job.rx_seed.get_id();
+		cj.data = chk->blob;
+		cj.data_len = job.prepow_len;
+	}
+	else
+	{
+		uint64_t total_nonce = extra_nonce;
+		total_nonce <<= 32;
+		total_nonce |= nonce;
+
+		cj.dataset_id = ethash::get_epoch_number(job.height);
+		cj.data = chk->blob;
+		cj.data_len = job.prepow_len - sizeof(uint64_t);
+		cj.block_number = job.height;
+		cj.nonce = total_nonce;
+		cj.has_header_hash = pp_header.matches(jobid, extra_nonce);
+		if(cj.has_header_hash)
+			cj.header_hash = pp_header.hash;
+	}
+
+	if(!verify_pool::inst().push_job(cj))
+	{
+		logger::inst().warn("Precalculated dataset for a job was not found! We lost a share!");
+		delete chk;
+		return false;
 	}
+
+	/* Results are only picked up by this thread, so counting after the push is fine */
+	inflight_checks++;
+	check_q.pending++;
+	return true;
 }
 
 bool client::on_new_block(int64_t timestamp_ms)
@@ -348,25 +606,13 @@ bool client::on_new_block(int64_t timestamp_ms)
 	if(!logged_in)
 		return true;
 
-	memcpy(cur_job.prepow + cur_job.prepow_len - sizeof(uint32_t)*2, &extra_nonce, sizeof(uint32_t));
-
-	char hex_jobid[9];
-	char hex_target[9];
-	char hex_blob[768];
-	const char* pow_type = pow_type_to_str(cur_job.type);
+	/* Same bytes for every miner but our three hex fields */
+	const job_template& t = cur_job->notify;
+	sock_buffer& out = get_thd_state().send_buf;
+	memcpy(out.buf, t.msg, t.len);
+	patch_job_template(out.buf, 0);
+	out.len = t.len;
 
-	bin2hex(cur_job.prepow, cur_job.prepow_len, hex_blob);
-	bin2hex((const unsigned char*)&jobid, sizeof(uint32_t), hex_jobid);
-	uint32_t t = diff_to_target(fix_diff);
-	bin2hex((const unsigned char*)&t, sizeof(uint32_t), hex_target);
-	
-	char seed_hash[65];
-	bin2hex(cur_job.rx_seed.data, cur_job.rx_seed.size, seed_hash);
-
-	send_buf.len = snprintf(send_buf.buf, sizeof(send_buf.buf), "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":"
-		"{\"blob\":\"%s\",\"job_id\":\"%s\",\"target\":\"%s\",\"pow_algo\":\"%s\",\"seed_hash\":\"%s\",\"height\":%u}}\n",
-		hex_blob, hex_jobid, hex_target, pow_type, seed_hash, cur_job.height);
-
-	net_send();
-	return true;
+	net_send(out);
+	return !aborting;
 }
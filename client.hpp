@@ -31,12 +31,14 @@
 #include <stdio.h>
 #include "socks.h"
 #include <stdexcept>
+#include <memory>
+#include <vector>
 
 #include "jconf.hpp"
-#include "json.h"
 #include "workstruct.hpp"
 #include "node.h"
 #include "check_job.hpp"
+#include "stratum_parser.hpp"
 
 struct sock_buffer
 {
@@ -62,13 +64,62 @@ struct client_ident
 	int32_t uid = -1;
 };
 
+/*
+ * A submit parked while the hash threads verify it. Holds a reference to the job and
+ * its own copy of the blob, so the client is free to move on to a new block before
+ * the result comes back.
+ */
+struct share_check
+{
+	uint32_t cli_idx;
+	uint64_t cli_gen;
+	int64_t call_id;
+	uint32_t nonce;
+	uint32_t extra_nonce;
+	uint32_t cli_jobid;
+	bool block_submitted;
+	std::shared_ptr<const jobdata> job;
+	uint8_t blob[sizeof(jobdata::prepow)];
+	check_job chk;
+};
+
 class client
 {
 public:
-	client(SOCKET fd, const in6_addr& ip_addr, in_port_t port);
+	using check_t = share_check;
+
+	/*
+	 * Everything a client only needs while its pool thread works on it. The send buffer
+	 * is used and emptied within one call, receive and send queue buffers are lent to
+	 * clients with a partial line pending or a congested socket. Owned by the client_pool,
+	 * so buffers go back to the pool they came from whichever thread frees the client.
+	 */
+	struct thd_state
+	{
+		constexpr static size_t max_spare_bufs = 64;
+
+		thd_state() = default;
+		~thd_state();
+
+		thd_state(const thd_state& r) = delete;
+		thd_state& operator=(const thd_state& r) = delete;
+
+		sock_buffer* take_buf();
+		void return_buf(sock_buffer* buf);
+
+		sock_buffer send_buf;
+		sock_buffer cork_buf;
+		std::vector<sock_buffer*> spare_bufs;
+	};
+
+	client(SOCKET fd, const in6_addr& ip_addr, in_port_t port, check_done_queue& check_q, thd_state& st, uint32_t pool_idx, uint64_t gen);
 
 	~client()
 	{
+		release_recv_buf();
+		release_send_q();
+		if(corked)
+			get_thd_state().cork_buf.len = 0;
 		if(aborting)
 			sock_abort(fd);
 		else
@@ -83,6 +134,7 @@ public:
 	static void set_limits()
 	{
 		max_calls_per_min = 60;// jconf::inst().get_max_calls_per_minute();
+		send_hwm = jconf::inst().get_client_send_hwm_kb() * 1024;
 		/*bad_share_ban_cnt = jconf::inst().get_bad_share_ban_cnt();
 		srv_start_diff = jconf::inst().get_starting_diff();
 		srv_const_diff = jconf::inst().get_server_const_diff();
@@ -95,6 +147,7 @@ public:
 	}
 
 	inline SOCKET get_fd() const { return fd; }
+	inline uint64_t get_gen() const { return gen; }
 
 	inline void hard_abort() { ::soft_shutdown(fd); aborting = true; }
 	inline void soft_shutdown() { ::soft_shutdown(fd); }
@@ -110,7 +163,10 @@ public:
 		if(aborting)
 			return -1;
 
-		int ret = read(fd, recv_buf.pos(), recv_buf.len_rem());
+		if(recv_buf == nullptr)
+			recv_buf = get_thd_state().take_buf();
+
+		int ret = read(fd, recv_buf->pos(), recv_buf->len_rem());
 		if(ret == -1)
 		{
 			if(errno != EAGAIN && errno != EWOULDBLOCK)
@@ -119,29 +175,42 @@ public:
 				return -1; // Exit due to lack of data, socket stays open
 		}
 
-		recv_buf.len += ret;
+		recv_buf->len += ret;
 		return ret;
 	}
 	
 	/*
-	 * We don't operate on large amounts of data, so if socket
-	 * is not writeable, it should be considered as a fatal error
+	 * Writes straight to the socket while nothing is queued. Whatever the socket
+	 * doesn't take goes to the send queue, which the pool flushes on EPOLLOUT.
+	 * A client whose queue would grow past send_hwm is aborted.
 	 */
-	inline void net_send()
-	{
-		if(size_t(write(fd, send_buf.buf, send_buf.len)) != send_buf.len)
-			hard_abort();
-		send_buf.len = 0;
-	}
+	void net_send(sock_buffer& out);
+
+	/*
+	 * While corked, net_send collects replies in the thread's cork buffer and uncork
+	 * writes them out together. Only one client per pool thread can be corked.
+	 */
+	inline void cork() { corked = true; }
+	bool uncork();
+
+	inline bool send_pending() const { return !send_q.empty(); }
+
+	// Called by the node once per job, before it is published
+	static void build_job_template(jobdata& job);
 
 	bool on_socket_read();
+	bool on_socket_write();
 	bool on_new_block(int64_t timestamp_ms);
+	bool on_check_done(share_check& chk);
 
 protected:
 	constexpr static uint32_t min_diff = 256;
 	constexpr static size_t hashrate_store_size = 1024;
+	constexpr static uint32_t max_inflight_checks = 32;
+	constexpr static uint32_t max_false_claims = 3; // Block claims that didn't verify before the client loses the priority lane
 
 	static size_t max_calls_per_min;
+	static size_t send_hwm;
 	static size_t bad_share_ban_cnt;
 	static uint32_t srv_start_diff;
 	static uint32_t srv_const_diff;
@@ -152,7 +221,7 @@ protected:
 
 	inline uint32_t diff_to_target(uint32_t diff) { return 0xFFFFFFFFUL / diff; }
 
-	inline uint64_t work_to_diff(uint64_t work)
+	static inline uint64_t work_to_diff(uint64_t work)
 	{
 		if(work == 0)
 			return 0xFFFFFFFFFFFFFFFFULL;
@@ -160,11 +229,35 @@ protected:
 			return 0xFFFFFFFFFFFFFFFFULL / work;
 	}
 
+	inline thd_state& get_thd_state() { return st; }
+
+	inline void release_recv_buf()
+	{
+		if(recv_buf != nullptr)
+			get_thd_state().return_buf(recv_buf);
+		recv_buf = nullptr;
+	}
+
+	void send_data(const char* data, size_t len);
+	void queue_send(const char* data, size_t len);
+	bool read_lines();
+	void release_send_q();
+
 	SOCKET fd;
+	check_done_queue& check_q;
+	thd_state& st;
+	uint32_t pool_idx;
+	uint64_t gen;
+	uint32_t inflight_checks = 0;
+	uint32_t false_claims = 0;
 	bool aborting = false;
-	char ip_addr_str[128];
-	sock_buffer recv_buf;
-	sock_buffer send_buf;
+	bool corked = false;
+	in6_addr ip_addr;
+	in_port_t port;
+	sock_buffer* recv_buf = nullptr; // Only while a partial line is pending
+	std::vector<sock_buffer*> send_q; // Only while the socket is congested
+	size_t send_q_off = 0; // Already written part of send_q.front()
+	size_t send_q_bytes = 0;
 
 	int64_t flood_timestamp = 0;
 	uint32_t flood_count = 0;
@@ -179,43 +272,55 @@ protected:
 		jobid++;
 	}
 
-	jobdata cur_job;
-	uint32_t jobid = 0;
+	// Job blob with our extra nonce, the shared job itself is never written to
+	void get_job_blob(uint8_t* blob);
 
-	uint32_t extra_nonce;
+	// Writes our extra nonce, job id and target into a copy of the template at base
+	void patch_job_template(char* base, size_t base_off);
 
-	static constexpr size_t json_buf_size = 4096;
-	uint8_t json_dom_buf[json_buf_size];
-	uint8_t json_parse_buf[json_buf_size];
-	MemoryPoolAllocator<> domAlloc;
-	MemoryPoolAllocator<> parseAlloc;
-	MemDocument jsonDoc;
+	std::shared_ptr<const jobdata> cur_job;
+	uint32_t jobid = 0;
 
-	inline void clear_json_bufs()
+	// ProgPoW header hash of one (job id, extra nonce) pair, learned from the first share checked
+	struct pp_header_cache
 	{
-		jsonDoc.SetNull();
-		domAlloc.Clear();
-		parseAlloc.Clear();
-		jsonDoc.SetNull();
-	}
+		uint32_t jobid = 0;
+		uint32_t extra_nonce = 0;
+		bool valid = false;
+		v32 hash;
+
+		inline bool matches(uint32_t jid, uint32_t en) const { return valid && jobid == jid && extra_nonce == en; }
+	};
+
+	pp_header_cache pp_header;
+
+	uint32_t extra_nonce;
 
 	bool process_line(char* buf, int len);
 
-	typedef void (client::*method_call)(int64_t call_id, const Value& args);
+	typedef void (client::*method_call)(const stratum_request& req);
 	
 	struct method_idx
 	{
 		const char* method;
+		uint32_t len;
 		method_call call;
 	};
 
-	const static method_idx call_tab[];
+	/* The method name lengths are unique modulo the table size, which makes it a perfect hash */
+	constexpr static size_t call_tab_size = 8;
+	static inline size_t method_hash(uint32_t len) { return len & (call_tab_size - 1); }
 
-	void process_method_login(int64_t call_id, const Value& args);
-	void process_method_submit(int64_t call_id, const Value& args);
-	void process_method_keepalive(int64_t call_id, const Value& args);
+	const static method_idx call_tab[call_tab_size];
+
+	void process_method_login(const stratum_request& req);
+	void process_method_submit(const stratum_request& req);
+	void process_method_keepalive(const stratum_request& req);
 	
 	void send_error_response(int64_t call_id, const char* msg);
 
-	check_job check_client_work(uint32_t nonce); 
+	bool check_client_work(int64_t call_id, uint32_t nonce, bool priority);
+
+	static void submit_block(share_check& chk);
+	static void on_block_candidate(check_job* job);
 };
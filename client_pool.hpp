@@ -28,6 +28,9 @@
 
 #pragma once
 
+#include "check_job.hpp"
+#include "cpu_affinity.hpp"
+#include "hugepage_alloc.hpp"
 #include "log.hpp"
 #include "socks.h"
 #include "time.hpp"
@@ -38,10 +41,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <atomic>
+#include <bitset>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 // Memory-holder object. We will allocate memory only in blocks of pool size, not for every single peer
 template<typename T>
@@ -87,11 +93,40 @@ private:
 	T* ptr;
 };
 
+// One block of client slots per pool, owned here so that a throwing pool constructor doesn't leak it
+template<typename T>
+struct client_slab
+{
+	explicit client_slab(size_t cnt) : cnt(cnt)
+	{
+		mem = static_cast<placement_mem<T>*>(hp_alloc(sizeof(placement_mem<T>) * cnt, "Client slab"));
+		if(mem == nullptr)
+			throw std::runtime_error("Failed to allocate client slab.");
+		for(size_t i = 0; i < cnt; i++)
+			new(&mem[i]) placement_mem<T>();
+	}
+
+	~client_slab()
+	{
+		for(size_t i = 0; i < cnt; i++)
+			mem[i].~placement_mem<T>();
+		hp_free(mem);
+	}
+
+	client_slab(const client_slab& r) = delete;
+	client_slab& operator=(const client_slab& r) = delete;
+
+	inline placement_mem<T>& operator[](size_t i) { return mem[i]; }
+
+	placement_mem<T>* mem;
+	size_t cnt;
+};
+
 template <typename cli_type, size_t pool_size>
 class client_pool
 {
 public:
-	client_pool() : active_cnt(0), thd_finished(false)
+	client_pool() : clients(pool_size), active_cnt(0), thd_finished(false), cli_gen_ctr(0)
 	{
 		if((epfd = epoll_create1(O_CLOEXEC)) == -1)
 			throw std::runtime_error("Limit of files / epoll instances reached.");
@@ -100,13 +135,20 @@ public:
 			throw std::runtime_error("Limit of files / pipe memory reached.");
 		
 		epoll_event event = {0};
-		event.data.u32 = uint32_t(-1);
+		event.data.u32 = pipe_evt_id;
 		event.events = EPOLLIN | EPOLLET;
 		
 		if(epoll_ctl(epfd, EPOLL_CTL_ADD, pipefds[0], &event) == -1)
 			throw std::runtime_error("Limit of max_user_watches reached.");
+
+		event.data.u32 = check_evt_id;
+		event.events = EPOLLIN | EPOLLET;
+
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, check_q.get_fd(), &event) == -1)
+			throw std::runtime_error("Limit of max_user_watches reached.");
 		
 		my_thd = std::thread(&client_pool<cli_type, pool_size>::pool_main, this);
+		pin_io_thread(my_thd);
 	}
 	
 	~client_pool()
@@ -157,6 +199,8 @@ public:
 
 private:
 	static constexpr int dummy_new_block_fd = -1;
+	static constexpr uint32_t pipe_evt_id = uint32_t(-1);
+	static constexpr uint32_t check_evt_id = uint32_t(-2);
 
 	struct pipe_msg
 	{
@@ -174,10 +218,35 @@ private:
 		if(epoll_ctl(epfd, EPOLL_CTL_DEL, clients[idx].get()->get_fd(), nullptr) == -1)
 			throw std::runtime_error("File descriptor double free");
 
+		write_armed.reset(idx);
 		clients[idx].free();
 		active_cnt--;
 	}
 	
+	/* EPOLLOUT is only armed while a client has queued output, otherwise it would fire on every read */
+	void sync_client_events(uint32_t idx)
+	{
+		bool want_write = clients[idx].get()->send_pending();
+		if(want_write == write_armed.test(idx))
+			return;
+
+		epoll_event event = {0};
+		event.data.u32 = idx;
+		event.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+		if(epoll_ctl(epfd, EPOLL_CTL_MOD, clients[idx].get()->get_fd(), &event) == -1)
+			throw std::runtime_error("Modifying epoll events failed.");
+		write_armed.set(idx, want_write);
+	}
+
+	/* After every callback, drops the client or keeps its epoll events in line with its queue */
+	void on_client_result(uint32_t idx, bool keep)
+	{
+		if(keep)
+			sync_client_events(idx);
+		else
+			remove_client(idx);
+	}
+
 	void pool_main()
 	{
 		epoll_event events[pool_size];
@@ -196,26 +265,82 @@ private:
 			for(int i = 0; i < n; i++)
 			{
 				uint32_t mev = events[i].events;
-				if(events[i].data.u32 == uint32_t(-1))
+				if(events[i].data.u32 == pipe_evt_id)
 				{
 					process_pipe();
 					continue;
 				}
 
+				if(events[i].data.u32 == check_evt_id)
+				{
+					process_checks();
+					continue;
+				}
+
 				uint32_t idx = events[i].data.u32;
-				if(mev & EPOLLIN)
+				cli_type* cli = clients[idx].get();
+				if(cli == nullptr)
+					continue;
+
+				bool keep = (mev & (EPOLLIN | EPOLLOUT)) != 0; /* EPOLLERR EPOLLHUP alone */
+				if(keep && (mev & EPOLLOUT))
+					keep = cli->on_socket_write();
+				if(keep && (mev & EPOLLIN))
+					keep = cli->on_socket_read();
+				on_client_result(idx, keep);
+			}
+		}
+		while(active_cnt > 0 || check_q.pending > 0);
+		thd_finished = true;
+	}
+
+	/* Hash threads are done with some shares, hand them back to their clients */
+	void process_checks()
+	{
+		check_q.pop_all(done_checks);
+
+		/* Group the results by client, each client answers its share of the batch with one write */
+		std::stable_sort(done_checks.begin(), done_checks.end(), [](check_job* a, check_job* b) {
+			return get_check(a)->cli_idx < get_check(b)->cli_idx;
+		});
+
+		cli_type* corked = nullptr;
+		uint32_t corked_idx = 0;
+		for(check_job* job : done_checks)
+		{
+			typename cli_type::check_t* chk = get_check(job);
+			cli_type* cli = clients[chk->cli_idx].get();
+
+			/* Client may have disconnected and its slot reused while the share was being hashed */
+			if(cli != nullptr && cli->get_gen() == chk->cli_gen)
+			{
+				if(cli != corked)
 				{
-					if(!clients[idx].get()->on_socket_read())
-						remove_client(idx);
+					if(corked != nullptr)
+						on_client_result(corked_idx, corked->uncork());
+					corked = cli;
+					corked_idx = chk->cli_idx;
+					cli->cork();
 				}
-				else /* EPOLLERR EPOLLHUP */
+
+				if(!cli->on_check_done(*chk))
 				{
-					remove_client(idx);
+					remove_client(chk->cli_idx);
+					corked = nullptr;
 				}
 			}
+
+			delete chk;
+			check_q.pending--;
 		}
-		while(active_cnt > 0);
-		thd_finished = true;
+
+		if(corked != nullptr)
+			on_client_result(corked_idx, corked->uncork());
+	}
+
+	static inline typename cli_type::check_t* get_check(check_job* job)
+	{
+		return static_cast<typename cli_type::check_t*>(job->owner);
 	}
 	
 	void process_pipe()
@@ -241,8 +366,7 @@ private:
 					if(clients[cli_id].get() == nullptr)
 						continue;
 					
-					if(!clients[cli_id].get()->on_new_block(time_now_ms))
-						remove_client(cli_id);
+					on_client_result(cli_id, clients[cli_id].get()->on_new_block(time_now_ms));
 				}
 			}
 			else
@@ -260,7 +384,7 @@ private:
 				
 				try
 				{
-					clients[cli_id].construct(msg.cli_fd, msg.cli_ip, msg.cli_port);
+					clients[cli_id].construct(msg.cli_fd, msg.cli_ip, msg.cli_port, check_q, io_state, cli_id, cli_gen_ctr++);
 					event.data.u32 = cli_id;
 					event.events = EPOLLIN | EPOLLET;
 					
@@ -280,9 +404,14 @@ private:
 		}
 	}
 
-	placement_mem<cli_type> clients[pool_size];
+	typename cli_type::thd_state io_state; // Declared before clients, which return buffers to it when destroyed
+	client_slab<cli_type> clients;
 	std::atomic<uint32_t> active_cnt;
 	std::atomic<bool> thd_finished;
+	check_done_queue check_q;
+	std::vector<check_job*> done_checks;
+	std::bitset<pool_size> write_armed;
+	uint64_t cli_gen_ctr;
 	int epfd;
 	int pipefds[2];
 	std::thread my_thd;
@@ -0,0 +1,287 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "cpu_affinity.hpp"
+#include "jconf.hpp"
+#include "log.hpp"
+
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Parses the kernel cpulist format, for example "0-7,16-23" */
+static bool read_cpulist(const char* path, std::vector<uint32_t>& out)
+{
+	FILE* fp = fopen(path, "r");
+	if(fp == nullptr)
+		return false;
+
+	out.clear();
+	unsigned int start, end;
+	char sep;
+	int ret;
+	while((ret = fscanf(fp, "%u%c", &start, &sep)) >= 1)
+	{
+		end = start;
+		if(ret == 2 && sep == '-')
+		{
+			if(fscanf(fp, "%u%c", &end, &sep) < 1)
+				break;
+		}
+
+		for(uint32_t i = start; i <= end; i++)
+			out.push_back(i);
+
+		if(ret == 1 || sep != ',')
+			break;
+	}
+	fclose(fp);
+
+	return !out.empty();
+}
+
+bool get_numa_node_cpus(uint32_t node, std::vector<uint32_t>& cpus)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+	return read_cpulist(path, cpus);
+}
+
+bool get_online_numa_nodes(std::vector<uint32_t>& nodes)
+{
+	return read_cpulist("/sys/devices/system/node/online", nodes);
+}
+
+bool set_thread_affinity(std::thread& thd, const std::vector<uint32_t>& cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(uint32_t cpu : cpus)
+	{
+		if(cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+
+	return pthread_setaffinity_np(thd.native_handle(), sizeof(cpu_set_t), &set) == 0;
+}
+
+const std::vector<uint32_t>& get_replica_nodes()
+{
+	static const std::vector<uint32_t> nodes = []() {
+		std::vector<uint32_t> nodes;
+		if(jconf::inst().get_numa_replicas())
+		{
+			if(jconf::inst().get_dataset_shared_memory())
+				logger::inst().warn("numa_replicas doesn't work with dataset_shared_memory, using a single dataset copy.");
+			else if(!get_online_numa_nodes(nodes))
+				logger::inst().warn("Failed to read NUMA topology, using a single dataset copy.");
+		}
+
+		if(nodes.size() <= 1)
+			nodes.assign(1, 0);
+		return nodes;
+	}();
+	return nodes;
+}
+
+bool bind_memory_to_node(const void* addr, size_t len, uint32_t node)
+{
+	constexpr size_t mask_bits = 1024;
+	constexpr size_t word_bits = 8 * sizeof(unsigned long);
+	if(node >= mask_bits)
+		return false;
+
+	unsigned long mask[mask_bits / word_bits] = {0};
+	mask[node / word_bits] = 1ul << (node % word_bits);
+
+	/* mbind wants a page aligned start */
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = uintptr_t(addr) & ~(page - 1);
+	len += uintptr_t(addr) - start;
+
+	return syscall(SYS_mbind, start, len, MPOL_BIND, mask, mask_bits, MPOL_MF_MOVE) == 0;
+}
+
+void pin_current_thread_to_node(uint32_t node)
+{
+	std::vector<uint32_t> cpus;
+	if(!get_numa_node_cpus(node, cpus))
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(uint32_t cpu : cpus)
+	{
+		if(cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+inline size_t get_node_replica(uint32_t node)
+{
+	const std::vector<uint32_t>& nodes = get_replica_nodes();
+	for(size_t i = 0; i < nodes.size(); i++)
+	{
+		if(nodes[i] == node)
+			return i;
+	}
+	return 0;
+}
+
+inline size_t get_cpu_replica(uint32_t cpu)
+{
+	const std::vector<uint32_t>& nodes = get_replica_nodes();
+	std::vector<uint32_t> cpus;
+	for(size_t i = 0; i < nodes.size(); i++)
+	{
+		if(!get_numa_node_cpus(nodes[i], cpus))
+			continue;
+		for(uint32_t c : cpus)
+		{
+			if(c == cpu)
+				return i;
+		}
+	}
+	return 0;
+}
+
+size_t get_verify_thread_replica(size_t thd_idx)
+{
+	size_t replica_cnt = get_replica_count();
+	if(replica_cnt == 1)
+		return 0;
+
+	size_t cpu_cnt = jconf::inst().get_verify_cpu_count();
+	int32_t numa_node = jconf::inst().get_verify_numa_node();
+
+	if(cpu_cnt > 0)
+		return get_cpu_replica(jconf::inst().get_verify_cpu(thd_idx % cpu_cnt));
+	else if(numa_node >= 0)
+		return get_node_replica(numa_node);
+	else
+		return thd_idx % replica_cnt;
+}
+
+void pin_verify_thread(std::thread& thd, size_t thd_idx)
+{
+	std::vector<uint32_t> cpus;
+	size_t cpu_cnt = jconf::inst().get_verify_cpu_count();
+	int32_t numa_node = jconf::inst().get_verify_numa_node();
+	size_t replica = get_verify_thread_replica(thd_idx);
+
+	/* Without explicit placement, replicas spread the threads over their nodes */
+	if(cpu_cnt == 0 && numa_node < 0 && get_replica_count() > 1)
+		numa_node = get_replica_nodes()[replica];
+
+	if(cpu_cnt > 0)
+	{
+		cpus.push_back(jconf::inst().get_verify_cpu(thd_idx % cpu_cnt));
+		if(set_thread_affinity(thd, cpus))
+			logger::inst().info("Verify thread ", thd_idx, " pinned to CPU ", cpus[0], ", dataset replica ", replica);
+		else
+			logger::inst().warn("Failed to pin verify thread ", thd_idx, " to CPU ", cpus[0]);
+	}
+	else if(numa_node >= 0)
+	{
+		if(!get_numa_node_cpus(numa_node, cpus))
+		{
+			logger::inst().warn("NUMA node ", numa_node, " not found, verify thread ", thd_idx, " is not pinned.");
+			return;
+		}
+
+		if(set_thread_affinity(thd, cpus))
+			logger::inst().info("Verify thread ", thd_idx, " pinned to NUMA node ", numa_node, ", dataset replica ", replica);
+		else
+			logger::inst().warn("Failed to pin verify thread ", thd_idx, " to NUMA node ", numa_node);
+	}
+}
+
+void pin_io_thread(std::thread& thd)
+{
+	/* Same precedence as pin_verify_thread, an explicit CPU list wins over the NUMA node */
+	std::vector<uint32_t> reserved;
+	size_t cpu_cnt = jconf::inst().get_verify_cpu_count();
+	int32_t numa_node = jconf::inst().get_verify_numa_node();
+	if(cpu_cnt > 0)
+	{
+		for(size_t i = 0; i < cpu_cnt; i++)
+			reserved.push_back(jconf::inst().get_verify_cpu(i));
+	}
+	else if(numa_node < 0 || !get_numa_node_cpus(numa_node, reserved))
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(cpu_set_t), &set) != 0)
+		return;
+
+	for(uint32_t cpu : reserved)
+	{
+		if(cpu < CPU_SETSIZE)
+			CPU_CLR(cpu, &set);
+	}
+
+	/* Every CPU is reserved for hashing, leave the scheduler to it */
+	if(CPU_COUNT(&set) == 0)
+		return;
+
+	pthread_setaffinity_np(thd.native_handle(), sizeof(cpu_set_t), &set);
+}
+
+void print_numa_topology()
+{
+	std::vector<uint32_t> nodes;
+	if(!get_online_numa_nodes(nodes))
+	{
+		logger::inst().info("NUMA topology not available.");
+		return;
+	}
+
+	logger::inst().info("NUMA topology: ", nodes.size(), " node(s)");
+	std::vector<uint32_t> cpus;
+	for(uint32_t node : nodes)
+	{
+		if(!get_numa_node_cpus(node, cpus))
+			continue;
+		logger::inst().info("NUMA node ", node, ": ", cpus.size(), " CPUs, ", cpus.front(), " to ", cpus.back());
+	}
+
+	const std::vector<uint32_t>& replica_nodes = get_replica_nodes();
+	if(replica_nodes.size() == 1)
+	{
+		logger::inst().info("Dataset replicas: off");
+		return;
+	}
+
+	for(size_t i = 0; i < replica_nodes.size(); i++)
+		logger::inst().info("Dataset replica ", i, " on NUMA node ", replica_nodes[i]);
+}
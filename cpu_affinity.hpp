@@ -0,0 +1,59 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <inttypes.h>
+#include <thread>
+#include <vector>
+
+/*
+ * Thread placement for the verification threads. Hash threads take CPUs from
+ * "verify_cpu_list" round-robin (or the whole "verify_numa_node"), while epoll
+ * threads are kept off the CPUs reserved for hashing.
+ *
+ * With "numa_replicas" every NUMA node gets its own copy of the datasets, and a
+ * hash thread uses the replica of the node it runs on.
+ */
+
+bool get_numa_node_cpus(uint32_t node, std::vector<uint32_t>& cpus);
+bool get_online_numa_nodes(std::vector<uint32_t>& nodes);
+bool set_thread_affinity(std::thread& thd, const std::vector<uint32_t>& cpus);
+
+// NUMA node of every dataset replica, a single entry when replication is off
+const std::vector<uint32_t>& get_replica_nodes();
+inline size_t get_replica_count() { return get_replica_nodes().size(); }
+
+// Moves memory to the node and keeps future faults there
+bool bind_memory_to_node(const void* addr, size_t len, uint32_t node);
+void pin_current_thread_to_node(uint32_t node);
+
+size_t get_verify_thread_replica(size_t thd_idx);
+void pin_verify_thread(std::thread& thd, size_t thd_idx);
+void pin_io_thread(std::thread& thd);
+
+void print_numa_topology();
@@ -0,0 +1,174 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "dataset_builder.hpp"
+#include "log.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <exception>
+
+dataset_builder::dataset_builder()
+{
+	/* The thread calling parallel_for works too, so one worker less than there are cores */
+	size_t worker_cnt = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+	threads.reserve(max_builds + worker_cnt);
+	for(size_t i = 0; i < max_builds; i++)
+		threads.emplace_back(&dataset_builder::build_main, this);
+	for(size_t i = 0; i < worker_cnt; i++)
+		threads.emplace_back(&dataset_builder::worker_main, this);
+}
+
+void dataset_builder::submit(cache_kind kind, uint64_t id, std::function<void()> build, std::function<void()> fail)
+{
+	std::unique_lock<std::mutex> lk(build_mtx);
+	builds.push_back({ kind, id, get_timestamp_ms(), std::move(build), std::move(fail) });
+	lk.unlock();
+	build_cv.notify_one();
+}
+
+void dataset_builder::build_main()
+{
+	while(true)
+	{
+		std::unique_lock<std::mutex> lk(build_mtx);
+		build_cv.wait(lk, [this] { return !builds.empty(); });
+		build_task task = std::move(builds.front());
+		builds.pop_front();
+		lk.unlock();
+
+		const char* name = task.kind == cache_kind::randomx ? "RandomX" : "ProgPoW";
+		uint64_t wait_ms = get_timestamp_ms() - task.queued_ms;
+		if(wait_ms > 100)
+			logger::inst().info(name, " dataset ", task.id, " waited ", size_t(wait_ms), " ms for a free builder.");
+
+		try
+		{
+			task.build();
+		}
+		catch(const std::exception& e)
+		{
+			logger::inst().err(name, " dataset ", task.id, " failed to build: ", e.what());
+			task.fail();
+			notify(task.kind, task.id, false);
+		}
+	}
+}
+
+void dataset_builder::subscribe(ready_handler fn)
+{
+	std::unique_lock<std::mutex> lk(handler_mtx);
+	handlers.push_back(std::move(fn));
+}
+
+void dataset_builder::notify(cache_kind kind, uint64_t id, bool ok)
+{
+	std::unique_lock<std::mutex> lk(handler_mtx);
+	std::vector<ready_handler> call = handlers;
+	lk.unlock();
+
+	for(ready_handler& fn : call)
+		fn(kind, id, ok);
+}
+
+/* Called with work_mtx held, returns false once every chunk of work is claimed */
+bool dataset_builder::run_chunk(range_work& w, std::unique_lock<std::mutex>& lk)
+{
+	if(w.next >= w.item_cnt)
+		return false;
+
+	uint64_t first = w.next;
+	uint64_t cnt = std::min(w.chunk, w.item_cnt - first);
+	w.next += cnt;
+	w.users++;
+	lk.unlock();
+
+	(*w.fn)(first, cnt);
+
+	lk.lock();
+	w.done += cnt;
+	w.users--;
+	if(w.done == w.item_cnt && w.users == 0)
+		done_cv.notify_all();
+	return true;
+}
+
+void dataset_builder::worker_main()
+{
+	std::unique_lock<std::mutex> lk(work_mtx);
+	while(true)
+	{
+		range_work* w = nullptr;
+		work_cv.wait(lk, [this, &w] {
+			for(range_work* it : work)
+			{
+				if(it->next < it->item_cnt)
+				{
+					w = it;
+					return true;
+				}
+			}
+			return false;
+		});
+
+		run_chunk(*w, lk);
+	}
+}
+
+void dataset_builder::parallel_for(const char* what, uint64_t item_cnt, const range_fn& fn)
+{
+	if(item_cnt == 0)
+		return;
+
+	/* Small enough chunks that the last ones don't leave most cores idle */
+	uint64_t chunk = std::max<uint64_t>(1, item_cnt / (uint64_t(threads.size()) * 64));
+	range_work w = { &fn, item_cnt, chunk, 0, 0, 0 };
+	uint64_t start_ms = get_timestamp_ms();
+	uint64_t log_ms = start_ms;
+
+	auto log_progress = [&]() {
+		uint64_t now = get_timestamp_ms();
+		if(now - log_ms < progress_interval_ms)
+			return;
+		log_ms = now;
+		logger::inst().info(what, ": ", size_t(w.done * 100 / item_cnt), "% after ", size_t((now - start_ms) / 1000), " s");
+	};
+
+	std::unique_lock<std::mutex> lk(work_mtx);
+	work.push_back(&w);
+	work_cv.notify_all();
+
+	while(run_chunk(w, lk))
+		log_progress();
+
+	work.remove(&w);
+	while(!done_cv.wait_for(lk, std::chrono::milliseconds(progress_interval_ms),
+		[&w] { return w.done == w.item_cnt && w.users == 0; }))
+		log_progress();
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <inttypes.h>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dataset_cache.hpp"
+
+/*
+ * Runs dataset builds on a bounded set of threads, instead of a detached thread per
+ * dataset. Item calculation is split over one shared set of workers (parallel_for),
+ * so two builds at once share the cores rather than oversubscribing them. Whoever
+ * needs to know when a dataset becomes usable subscribes to the ready event, which
+ * also fires (with ok false) when a build throws.
+ */
+class dataset_builder
+{
+public:
+	typedef std::function<void(cache_kind kind, uint64_t id, bool ok)> ready_handler;
+	typedef std::function<void(uint64_t first, uint64_t cnt)> range_fn;
+
+	inline static dataset_builder& inst()
+	{
+		static dataset_builder inst;
+		return inst;
+	};
+
+	// Queues a build, it runs once one of the build threads is free. fail runs if build throws, before the handlers
+	void submit(cache_kind kind, uint64_t id, std::function<void()> build, std::function<void()> fail);
+
+	// Calls fn over [0, item_cnt) in chunks on every worker and the caller, logs progress, returns when all is done.
+	// fn must not throw, the chunks of other workers would be left running
+	void parallel_for(const char* what, uint64_t item_cnt, const range_fn& fn);
+
+	// Handlers run on the build thread, right after the dataset is marked ready or failed
+	void subscribe(ready_handler fn);
+	inline void notify_ready(cache_kind kind, uint64_t id) { notify(kind, id, true); }
+
+private:
+	// Builds mostly wait on parallel_for, two let a RandomX and a ProgPoW dataset overlap
+	constexpr static size_t max_builds = 2;
+	constexpr static uint64_t progress_interval_ms = 5000;
+
+	dataset_builder();
+
+	struct build_task
+	{
+		cache_kind kind;
+		uint64_t id;
+		uint64_t queued_ms;
+		std::function<void()> build;
+		std::function<void()> fail;
+	};
+
+	struct range_work
+	{
+		const range_fn* fn;
+		uint64_t item_cnt;
+		uint64_t chunk;
+		uint64_t next; // First unclaimed item
+		uint64_t done; // Items finished
+		size_t users; // Workers inside a chunk
+	};
+
+	void notify(cache_kind kind, uint64_t id, bool ok);
+	void build_main();
+	void worker_main();
+	bool run_chunk(range_work& work, std::unique_lock<std::mutex>& lk);
+
+	std::mutex build_mtx;
+	std::condition_variable build_cv;
+	std::deque<build_task> builds;
+
+	std::mutex work_mtx;
+	std::condition_variable work_cv;
+	std::condition_variable done_cv;
+	std::list<range_work*> work;
+
+	std::mutex handler_mtx;
+	std::vector<ready_handler> handlers;
+
+	std::vector<std::thread> threads;
+};
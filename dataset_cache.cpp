@@ -0,0 +1,293 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "dataset_cache.hpp"
+#include "dataset_builder.hpp"
+#include "jconf.hpp"
+#include "log.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char cache_magic[8] = {'E', 'P', 'I', 'C', 'D', 'S', 'C', 0};
+constexpr uint32_t cache_version = 2;
+constexpr size_t checksum_block = 16 * 1024 * 1024;
+
+struct cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t kind;
+	uint64_t id;
+	uint8_t key[32];
+	uint8_t tag[32];
+	uint64_t payload_len;
+	uint64_t checksum;
+};
+
+inline uint64_t checksum_mix(uint64_t h, uint64_t w)
+{
+	h ^= w;
+	h *= 0xff51afd7ed558ccdull;
+	return h ^ (h >> 32);
+}
+
+inline uint64_t checksum_block_sum(const uint8_t* data, size_t len)
+{
+	uint64_t h = checksum_mix(0x9e3779b97f4a7c15ull, len);
+	size_t i;
+	for(i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+	{
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(w));
+		h = checksum_mix(h, w);
+	}
+	for(; i < len; i++)
+		h = checksum_mix(h, data[i]);
+	return h;
+}
+
+/*
+ * Checksum over fixed size blocks, so the result doesn't depend on how the builder splits them.
+ * If out isn't null every block is also copied there, while it is still in cache.
+ */
+static uint64_t checksum_mt(const uint8_t* data, uint8_t* out, size_t len)
+{
+	size_t block_cnt = (len + checksum_block - 1) / checksum_block;
+	std::vector<uint64_t> sums(block_cnt);
+
+	dataset_builder::inst().parallel_for("Dataset checksum", block_cnt, [&](uint64_t first, uint64_t cnt) {
+		for(size_t b = first; b < first + cnt; b++)
+		{
+			size_t off = b * checksum_block;
+			size_t blen = std::min(checksum_block, len - off);
+			if(out != nullptr)
+			{
+				memcpy(out + off, data + off, blen);
+				sums[b] = checksum_block_sum(out + off, blen);
+			}
+			else
+				sums[b] = checksum_block_sum(data + off, blen);
+		}
+	});
+
+	uint64_t h = len;
+	for(uint64_t s : sums)
+		h = checksum_mix(h, s);
+	return h;
+}
+
+inline bool write_all(int fd, const uint8_t* data, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t ret = write(fd, data, len);
+		if(ret == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+dataset_cache::dataset_cache() : dir(jconf::inst().get_dataset_cache_dir()), keep_cnt(jconf::inst().get_dataset_slots())
+{
+	if(enabled() && mkdir(dir.c_str(), S_IRWXU) == -1 && errno != EEXIST)
+	{
+		logger::inst().err("Failed to create dataset cache directory ", dir.c_str(), ", ", strerror(errno), ". Dataset cache disabled.");
+		dir.clear();
+	}
+}
+
+std::string dataset_cache::file_name(cache_kind kind, uint64_t id)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s%016" PRIx64 ".dat", cache_kind_prefix(kind), id);
+	return dir + "/" + name;
+}
+
+bool dataset_cache::load(cache_kind kind, uint64_t id, const v32& key, uint8_t* out, size_t len, v32* tag)
+{
+	if(!enabled())
+		return false;
+
+	std::string fn = file_name(kind, id);
+	int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return false;
+
+	uint64_t start_ms = get_timestamp_ms();
+	struct stat sb;
+	size_t file_len = sizeof(cache_header) + len;
+	if(fstat(fd, &sb) == -1 || size_t(sb.st_size) != file_len)
+	{
+		close(fd);
+		logger::inst().warn("Dataset cache file ", fn.c_str(), " has the wrong size, discarding it.");
+		unlink(fn.c_str());
+		return false;
+	}
+
+	void* map = mmap(nullptr, file_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		logger::inst().warn("Failed to map dataset cache file ", fn.c_str(), ", ", strerror(errno));
+		return false;
+	}
+
+	madvise(map, file_len, MADV_SEQUENTIAL);
+	const cache_header* hdr = static_cast<const cache_header*>(map);
+	const uint8_t* payload = static_cast<const uint8_t*>(map) + sizeof(cache_header);
+
+	bool ok = memcmp(hdr->magic, cache_magic, sizeof(cache_magic)) == 0 &&
+		hdr->version == cache_version && hdr->kind == uint32_t(kind) && hdr->id == id &&
+		memcmp(hdr->key, key.data, sizeof(hdr->key)) == 0 && hdr->payload_len == len;
+
+	if(ok)
+		ok = checksum_mt(payload, out, len) == hdr->checksum;
+	if(ok && tag != nullptr)
+		memcpy(tag->data, hdr->tag, sizeof(hdr->tag));
+
+	munmap(map, file_len);
+
+	if(!ok)
+	{
+		logger::inst().warn("Dataset cache file ", fn.c_str(), " failed the integrity check, discarding it.");
+		unlink(fn.c_str());
+		return false;
+	}
+
+	logger::inst().info("Loaded ", size_t(len >> 20), " MiB dataset from ", fn.c_str(), " in ", size_t(get_timestamp_ms() - start_ms), " ms.");
+	return true;
+}
+
+void dataset_cache::store(cache_kind kind, uint64_t id, const v32& key, const uint8_t* data, size_t len, const v32* tag)
+{
+	if(!enabled())
+		return;
+
+	cache_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+	hdr.version = cache_version;
+	hdr.kind = uint32_t(kind);
+	hdr.id = id;
+	memcpy(hdr.key, key.data, sizeof(hdr.key));
+	if(tag != nullptr)
+		memcpy(hdr.tag, tag->data, sizeof(hdr.tag));
+	hdr.payload_len = len;
+	hdr.checksum = checksum_mt(data, nullptr, len);
+
+	/*
+	 * Written under a temporary name, so a crash never leaves a half file behind the real one.
+	 * The pid keeps processes sharing the directory from truncating each other's file.
+	 */
+	std::string fn = file_name(kind, id);
+	std::string tmp_fn = fn + "." + std::to_string(getpid()) + ".tmp";
+	int fd = open(tmp_fn.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(fd == -1)
+	{
+		logger::inst().warn("Failed to create dataset cache file ", tmp_fn.c_str(), ", ", strerror(errno));
+		return;
+	}
+
+	bool ok = write_all(fd, reinterpret_cast<const uint8_t*>(&hdr), sizeof(hdr)) && write_all(fd, data, len) && fsync(fd) == 0;
+	close(fd);
+
+	if(!ok || rename(tmp_fn.c_str(), fn.c_str()) == -1)
+	{
+		logger::inst().warn("Failed to write dataset cache file ", fn.c_str(), ", ", strerror(errno));
+		unlink(tmp_fn.c_str());
+		return;
+	}
+
+	prune(kind);
+}
+
+/* Keeps the newest files of a kind, as many as we have dataset slots, and drops orphaned temp files */
+void dataset_cache::prune(cache_kind kind)
+{
+	DIR* dp = opendir(dir.c_str());
+	if(dp == nullptr)
+		return;
+
+	std::vector<std::pair<int64_t, std::string>> files;
+	const char* prefix = cache_kind_prefix(kind);
+	size_t prefix_len = strlen(prefix);
+	struct dirent* ent;
+	while((ent = readdir(dp)) != nullptr)
+	{
+		size_t name_len = strlen(ent->d_name);
+		if(strncmp(ent->d_name, prefix, prefix_len) != 0 || name_len < 4)
+			continue;
+
+		std::string fn = dir + "/" + ent->d_name;
+		if(strcmp(ent->d_name + name_len - 4, ".tmp") == 0)
+		{
+			/* Left behind by a process that died while writing */
+			const char* pid_str = strstr(ent->d_name, ".dat.");
+			long pid = pid_str != nullptr ? strtol(pid_str + 5, nullptr, 10) : 0;
+			if(pid > 0 && kill(pid_t(pid), 0) == -1 && errno == ESRCH)
+				unlink(fn.c_str());
+			continue;
+		}
+
+		if(strcmp(ent->d_name + name_len - 4, ".dat") != 0)
+			continue;
+
+		struct stat sb;
+		if(stat(fn.c_str(), &sb) == 0)
+			files.emplace_back(sb.st_mtime, fn);
+	}
+	closedir(dp);
+
+	if(files.size() <= keep_cnt)
+		return;
+
+	std::sort(files.begin(), files.end(), [](const std::pair<int64_t, std::string>& a, const std::pair<int64_t, std::string>& b) {
+		return a.first > b.first;
+	});
+
+	for(size_t i = keep_cnt; i < files.size(); i++)
+		unlink(files[i].second.c_str());
+}
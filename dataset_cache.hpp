@@ -0,0 +1,93 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+#include <string>
+
+#include "vector32.h"
+
+enum class cache_kind : uint32_t
+{
+	randomx = 1, // RandomX full dataset, keyed by seed
+	progpow = 2, // ProgPoW full DAG, keyed by epoch
+	randomx_light = 3, // RandomX cache memory, keyed by seed
+	progpow_light = 4 // ProgPoW light cache, keyed by epoch
+};
+
+// Names cache files and shared memory segments
+inline const char* cache_kind_prefix(cache_kind kind)
+{
+	switch(kind)
+	{
+	case cache_kind::randomx:
+		return "rx_";
+	case cache_kind::progpow:
+		return "pp_";
+	case cache_kind::randomx_light:
+		return "rxl_";
+	default:
+		return "ppl_";
+	}
+}
+
+/*
+ * Computed datasets and light caches kept on disk, so a restart doesn't have to rebuild them.
+ * Files are versioned, keyed by seed id or epoch, and carry a checksum of the
+ * payload. Anything that doesn't match is deleted and rebuilt.
+ */
+class dataset_cache
+{
+public:
+	inline static dataset_cache& inst()
+	{
+		static dataset_cache inst;
+		return inst;
+	};
+
+	inline bool enabled() const { return !dir.empty(); }
+
+	/*
+	 * Fills out with the cached payload, false if there is no valid file for the key. The file is
+	 * mapped and copied, so its page cache and out both hold the payload until the copy is done.
+	 * If tag isn't null it gets the 32 byte tag the payload was stored with.
+	 */
+	bool load(cache_kind kind, uint64_t id, const v32& key, uint8_t* out, size_t len, v32* tag = nullptr);
+	// tag is kept alongside the payload for the caller to check after a load, zero if null
+	void store(cache_kind kind, uint64_t id, const v32& key, const uint8_t* data, size_t len, const v32* tag = nullptr);
+
+private:
+	dataset_cache();
+
+	std::string file_name(cache_kind kind, uint64_t id);
+	void prune(cache_kind kind);
+
+	std::string dir;
+	size_t keep_cnt;
+};
@@ -0,0 +1,213 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+
+/*
+ * Bookkeeping for a fixed set of dataset slots shared by the verification threads.
+ * Every queued job holds a reference to its slot, so a slot is only recycled once
+ * nothing in flight needs it. Among the free slots the least recently used one goes.
+ */
+template <typename ds_t>
+class dataset_slots
+{
+public:
+	constexpr static size_t npos = size_t(-1);
+	constexpr static uint64_t no_id = uint64_t(-1);
+
+	dataset_slots(size_t cnt) : cnt(cnt), ds(new ds_t[cnt]), meta(new slot_meta[cnt]), lru_ctr(0), gen_ctr(0)
+	{
+	}
+
+	inline size_t size() const { return cnt; }
+	inline ds_t& operator[](size_t idx) { return ds[idx]; }
+
+	/*
+	 * Marks id as needed. Returns the slot the caller should build it in, or npos if it is
+	 * already loaded or building. Also npos while every slot is referenced or building, the
+	 * caller runs on the node thread and must not wait for verifies to drain. It asks again
+	 * with the next template, jobs for id stay pending until then.
+	 */
+	size_t reserve(uint64_t id)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		size_t idx = find_loaded(id);
+		if(idx != npos)
+		{
+			meta[idx].last_used = ++lru_ctr;
+			return npos;
+		}
+
+		if((idx = find_victim()) == npos)
+			return npos;
+
+		meta[idx].loaded_id = id;
+		meta[idx].ready_id = no_id;
+		meta[idx].last_used = ++lru_ctr;
+		return idx;
+	}
+
+	void set_ready(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		meta[idx].ready_id = meta[idx].loaded_id;
+		meta[idx].ready_gen = ++gen_ctr;
+	}
+
+	/* Takes a reference on the slot holding id (ready or building), npos if there is none */
+	size_t acquire(uint64_t id)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		size_t idx = find_loaded(id);
+		if(idx != npos)
+		{
+			meta[idx].refs++;
+			meta[idx].last_used = ++lru_ctr;
+		}
+		return idx;
+	}
+
+	void release(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		meta[idx].refs--;
+	}
+
+	/*
+	 * The build failed, the slot forgets its id. Jobs still holding a reference see it as
+	 * failed, reserve hands the slot out again once they are gone. No-op once ready.
+	 */
+	void set_failed(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		if(meta[idx].ready_id == meta[idx].loaded_id)
+			return;
+		meta[idx].loaded_id = no_id;
+		meta[idx].ready_id = no_id;
+	}
+
+	/* Caller holds a reference, so the slot can't change under us */
+	bool is_slot_ready(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		return meta[idx].loaded_id != no_id && meta[idx].ready_id == meta[idx].loaded_id;
+	}
+
+	/* Caller holds a reference, a referenced slot only loses its id through set_failed */
+	bool is_slot_failed(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		return meta[idx].loaded_id == no_id;
+	}
+
+	/* True unless id is ready: it is building, or reserve found no free slot for it yet */
+	bool is_pending(uint64_t id)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		size_t idx = find_loaded(id);
+		return idx == npos || meta[idx].ready_id != id;
+	}
+
+	// Unique for every build of every slot, unlike the id which comes back after a release_all
+	uint64_t get_ready_gen(size_t idx)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		return meta[idx].ready_gen;
+	}
+
+	/*
+	 * Forgets every slot if none is referenced or building, after which the caller may free
+	 * the slot memory. Returns false if anything is in use or there was nothing loaded.
+	 */
+	bool release_all()
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		bool loaded = false;
+		for(size_t i = 0; i < cnt; i++)
+		{
+			if(meta[i].refs > 0 || meta[i].ready_id != meta[i].loaded_id)
+				return false;
+			loaded |= meta[i].loaded_id != no_id;
+		}
+
+		for(size_t i = 0; i < cnt; i++)
+		{
+			meta[i].loaded_id = no_id;
+			meta[i].ready_id = no_id;
+			meta[i].last_used = 0;
+		}
+		return loaded;
+	}
+
+private:
+	struct slot_meta
+	{
+		slot_meta() : loaded_id(no_id), ready_id(no_id), ready_gen(0), refs(0), last_used(0) {}
+
+		uint64_t loaded_id; // id calculating or ready
+		uint64_t ready_id; // id that is ready, set after calculation
+		uint64_t ready_gen;
+		size_t refs;
+		uint64_t last_used;
+	};
+
+	inline size_t find_loaded(uint64_t id)
+	{
+		for(size_t i = 0; i < cnt; i++)
+		{
+			if(meta[i].loaded_id == id)
+				return i;
+		}
+		return npos;
+	}
+
+	/* Unreferenced slot that is not being built, empty ones first */
+	inline size_t find_victim()
+	{
+		size_t idx = npos;
+		for(size_t i = 0; i < cnt; i++)
+		{
+			const slot_meta& m = meta[i];
+			if(m.refs > 0 || m.ready_id != m.loaded_id)
+				continue;
+			if(idx == npos || m.last_used < meta[idx].last_used)
+				idx = i;
+		}
+		return idx;
+	}
+
+	size_t cnt;
+	std::unique_ptr<ds_t[]> ds;
+	std::unique_ptr<slot_meta[]> meta;
+	uint64_t lru_ctr;
+	uint64_t gen_ctr;
+	std::mutex mtx;
+};
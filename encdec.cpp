@@ -25,8 +25,13 @@
 // INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
 // STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-
 #include "encdec.h"
+#include "encdec_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_SIMD
+#endif
 
 inline unsigned char hf_hex2bin(char c, bool& err)
 {
@@ -41,7 +46,7 @@ inline unsigned char hf_hex2bin(char c, bool& err)
 	return 0;
 }
 
-bool hex2bin(const char* in, unsigned int len, unsigned char* out)
+bool hex2bin_scalar(const char* in, unsigned int len, unsigned char* out)
 {
 	bool error = false;
 	for(unsigned int i = 0; i < len; i += 2)
@@ -61,7 +66,7 @@ inline char hf_bin2hex(unsigned char c)
 		return 'a' - 0xA + c;
 }
 
-void bin2hex(const unsigned char* in, unsigned int len, char* out)
+void bin2hex_scalar(const unsigned char* in, unsigned int len, char* out)
 {
 	for(unsigned int i = 0; i < len; i++)
 	{
@@ -71,3 +76,163 @@ void bin2hex(const unsigned char* in, unsigned int len, char* out)
 	out[len*2] = '\0';
 }
 
+#ifdef HEX_SIMD
+/*
+ * Encoding looks both nibbles up in a 16 entry table with pshufb and interleaves them.
+ * Decoding maps every character to its digit value and a valid mask in parallel:
+ * '0'-'9' and case-folded 'a'-'f' are two disjoint ranges, so one wrong character
+ * anywhere in the block shows up in the movemask. maddubs with 16,1 weights then
+ * joins the nibble pairs into 16 bit words that packus narrows to bytes.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i hex_digits_sse(__m128i c, __m128i& valid)
+{
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i md = _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8(9)), _mm_setzero_si128());
+	__m128i ml = _mm_cmpeq_epi8(_mm_subs_epu8(l, _mm_set1_epi8(5)), _mm_setzero_si128());
+	valid = _mm_and_si128(valid, _mm_or_si128(md, ml));
+	return _mm_or_si128(_mm_and_si128(md, d), _mm_and_si128(ml, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("ssse3")))
+bool hex2bin_ssse3(const char* in, unsigned int len, unsigned char* out)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	__m128i valid = _mm_set1_epi8(-1);
+	unsigned int i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m128i v0 = hex_digits_sse(_mm_loadu_si128((const __m128i*)(in + i)), valid);
+		__m128i v1 = hex_digits_sse(_mm_loadu_si128((const __m128i*)(in + i + 16)), valid);
+		v0 = _mm_maddubs_epi16(v0, weights);
+		v1 = _mm_maddubs_epi16(v1, weights);
+		_mm_storeu_si128((__m128i*)(out + i / 2), _mm_packus_epi16(v0, v1));
+	}
+
+	if(_mm_movemask_epi8(valid) != 0xFFFF)
+		return false;
+	return hex2bin_scalar(in + i, len - i, out + i / 2);
+}
+
+__attribute__((target("ssse3")))
+void bin2hex_ssse3(const unsigned char* in, unsigned int len, char* out)
+{
+	const __m128i table = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	unsigned int i = 0;
+	for(; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	bin2hex_scalar(in + i, len - i, out + i * 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_digits_avx(__m256i c, __m256i& valid)
+{
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i md = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, _mm256_set1_epi8(9)), _mm256_setzero_si256());
+	__m256i ml = _mm256_cmpeq_epi8(_mm256_subs_epu8(l, _mm256_set1_epi8(5)), _mm256_setzero_si256());
+	valid = _mm256_and_si256(valid, _mm256_or_si256(md, ml));
+	return _mm256_or_si256(_mm256_and_si256(md, d), _mm256_and_si256(ml, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+bool hex2bin_avx2(const char* in, unsigned int len, unsigned char* out)
+{
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	__m256i valid = _mm256_set1_epi8(-1);
+	unsigned int i = 0;
+	for(; i + 64 <= len; i += 64)
+	{
+		__m256i v0 = hex_digits_avx(_mm256_loadu_si256((const __m256i*)(in + i)), valid);
+		__m256i v1 = hex_digits_avx(_mm256_loadu_si256((const __m256i*)(in + i + 32)), valid);
+		v0 = _mm256_maddubs_epi16(v0, weights);
+		v1 = _mm256_maddubs_epi16(v1, weights);
+		// packus works per 128 bit lane, put the quarters back in order
+		__m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xD8);
+		_mm256_storeu_si256((__m256i*)(out + i / 2), r);
+	}
+
+	if(_mm256_movemask_epi8(valid) != -1)
+		return false;
+	// The tail runs legacy SSE code, avoid the AVX transition penalty
+	_mm256_zeroupper();
+	return hex2bin_ssse3(in + i, len - i, out + i / 2);
+}
+
+__attribute__((target("avx2")))
+void bin2hex_avx2(const unsigned char* in, unsigned int len, char* out)
+{
+	const __m256i table = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+		'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	unsigned int i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+		__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+		__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, mask));
+		__m256i a = _mm256_unpacklo_epi8(hi, lo);
+		__m256i b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i*)(out + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*)(out + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	_mm256_zeroupper();
+	bin2hex_ssse3(in + i, len - i, out + i * 2);
+}
+
+bool hex_have_ssse3()
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+bool hex_have_avx2()
+{
+	return __builtin_cpu_supports("avx2");
+}
+#else
+bool hex2bin_ssse3(const char* in, unsigned int len, unsigned char* out) { return hex2bin_scalar(in, len, out); }
+void bin2hex_ssse3(const unsigned char* in, unsigned int len, char* out) { bin2hex_scalar(in, len, out); }
+bool hex2bin_avx2(const char* in, unsigned int len, unsigned char* out) { return hex2bin_scalar(in, len, out); }
+void bin2hex_avx2(const unsigned char* in, unsigned int len, char* out) { bin2hex_scalar(in, len, out); }
+bool hex_have_ssse3() { return false; }
+bool hex_have_avx2() { return false; }
+#endif
+
+/* Constant initialised, so calls from other static constructors get the scalar kernels */
+static bool (*hex2bin_fn)(const char*, unsigned int, unsigned char*) = hex2bin_scalar;
+static void (*bin2hex_fn)(const unsigned char*, unsigned int, char*) = bin2hex_scalar;
+
+static struct hex_dispatch
+{
+	hex_dispatch()
+	{
+		if(hex_have_avx2())
+		{
+			hex2bin_fn = hex2bin_avx2;
+			bin2hex_fn = bin2hex_avx2;
+		}
+		else if(hex_have_ssse3())
+		{
+			hex2bin_fn = hex2bin_ssse3;
+			bin2hex_fn = bin2hex_ssse3;
+		}
+	}
+} hex_dispatch_init;
+
+bool hex2bin(const char* in, unsigned int len, unsigned char* out)
+{
+	return hex2bin_fn(in, len, out);
+}
+
+void bin2hex(const unsigned char* in, unsigned int len, char* out)
+{
+	bin2hex_fn(in, len, out);
+}
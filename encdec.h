@@ -29,5 +29,7 @@
 #pragma once
 #include <inttypes.h>
 
+// Both pick the widest kernel the CPU supports at startup
+// hex2bin returns false if any of the len characters is not a hex digit
 bool hex2bin(const char* in, unsigned int len, unsigned char* out);
 void bin2hex(const unsigned char* in, unsigned int len, char* out);
@@ -0,0 +1,201 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "hugepage_alloc.hpp"
+#include "log.hpp"
+#include "stats.hpp"
+
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+constexpr size_t page_size_1g = size_t(1) << 30;
+constexpr size_t page_size_2m = size_t(1) << 21;
+
+struct hp_block
+{
+	size_t map_len;
+	page_tier tier;
+};
+
+static std::mutex hp_mtx;
+static std::unordered_map<uintptr_t, hp_block> hp_blocks;
+
+const char* page_tier_name(page_tier tier)
+{
+	switch(tier)
+	{
+	case page_tier::huge_1g:
+		return "1 GiB huge";
+	case page_tier::huge_2m:
+		return "2 MiB huge";
+	case page_tier::thp:
+		return "transparent huge";
+	default:
+		return "normal";
+	}
+}
+
+inline size_t round_up(size_t len, size_t page)
+{
+	return (len + page - 1) & ~(page - 1);
+}
+
+inline bool tier_worth_it(size_t len, size_t page)
+{
+	return len >= page && round_up(len, page) - len <= len / 8;
+}
+
+static void* map_hugetlb(size_t map_len, int size_flag)
+{
+	void* ptr = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+/* Maps 2 MiB aligned, so the kernel can back the whole range with huge pages */
+static void* map_aligned(size_t map_len)
+{
+	size_t over_len = map_len + page_size_2m;
+	void* raw = mmap(nullptr, over_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(raw == MAP_FAILED)
+		return nullptr;
+
+	uintptr_t start = uintptr_t(raw);
+	uintptr_t aligned = round_up(start, page_size_2m);
+	if(aligned > start)
+		munmap(raw, aligned - start);
+	uintptr_t tail = aligned + map_len;
+	uintptr_t end = start + over_len;
+	if(end > tail)
+		munmap(reinterpret_cast<void*>(tail), end - tail);
+
+	return reinterpret_cast<void*>(aligned);
+}
+
+static stat_gauge& tier_gauge(page_tier tier)
+{
+	switch(tier)
+	{
+	case page_tier::huge_1g:
+		return stats::inst().mem_huge_1g_bytes;
+	case page_tier::huge_2m:
+		return stats::inst().mem_huge_2m_bytes;
+	case page_tier::thp:
+		return stats::inst().mem_thp_bytes;
+	default:
+		return stats::inst().mem_normal_bytes;
+	}
+}
+
+void* hp_alloc(size_t len, const char* what)
+{
+	void* ptr = nullptr;
+	size_t map_len = 0;
+	page_tier tier = page_tier::normal;
+
+	if(tier_worth_it(len, page_size_1g))
+	{
+		map_len = round_up(len, page_size_1g);
+		ptr = map_hugetlb(map_len, MAP_HUGE_1GB);
+		tier = page_tier::huge_1g;
+	}
+
+	if(ptr == nullptr && tier_worth_it(len, page_size_2m))
+	{
+		map_len = round_up(len, page_size_2m);
+		ptr = map_hugetlb(map_len, MAP_HUGE_2MB);
+		tier = page_tier::huge_2m;
+	}
+
+	/* THP only where the 2 MiB rounding pays off, small slabs keep their small footprint */
+	if(ptr == nullptr && tier_worth_it(len, page_size_2m))
+	{
+		map_len = round_up(len, page_size_2m);
+		ptr = map_aligned(map_len);
+		if(ptr != nullptr)
+			tier = madvise(ptr, map_len, MADV_HUGEPAGE) == 0 ? page_tier::thp : page_tier::normal;
+	}
+
+	if(ptr == nullptr)
+	{
+		map_len = round_up(len, size_t(sysconf(_SC_PAGESIZE)));
+		ptr = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		tier = page_tier::normal;
+		if(ptr == MAP_FAILED)
+		{
+			logger::inst().err("Failed to allocate ", size_t(len >> 20), " MiB for ", what, " (not enough RAM).");
+			return nullptr;
+		}
+	}
+
+	std::unique_lock<std::mutex> lk(hp_mtx);
+	hp_blocks[uintptr_t(ptr)] = { map_len, tier };
+	lk.unlock();
+
+	tier_gauge(tier).add(map_len);
+
+	/* Big ones are worth a line at info, client slabs come and go with the pools */
+	if(len >= (size_t(64) << 20))
+		logger::inst().info(what, ": ", size_t(len >> 20), " MiB on ", page_tier_name(tier), " pages");
+	else
+		logger::inst().dbghi(what, ": ", size_t(len >> 10), " KiB on ", page_tier_name(tier), " pages");
+
+	return ptr;
+}
+
+void hp_free(void* ptr)
+{
+	if(ptr == nullptr)
+		return;
+
+	std::unique_lock<std::mutex> lk(hp_mtx);
+	auto it = hp_blocks.find(uintptr_t(ptr));
+	if(it == hp_blocks.end())
+	{
+		logger::inst().err("hp_free on unknown pointer.");
+		return;
+	}
+	hp_block blk = it->second;
+	hp_blocks.erase(it);
+	lk.unlock();
+
+	munmap(ptr, blk.map_len);
+	tier_gauge(blk.tier).sub(blk.map_len);
+}
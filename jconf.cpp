@@ -36,6 +36,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <thread>
+
 const char* default_config_file = 
 #include "config_json.tmpl"
 ;
@@ -161,6 +163,77 @@ size_t jconf::get_fatal_node_timeout()
 	return d.configValues[iFatalNodeTimeout]->GetUint();
 }
 
+bool jconf::get_randomx_full_dataset()
+{
+	return d.configValues[bRxFullDataset]->GetBool();
+}
+
+bool jconf::get_progpow_full_dataset()
+{
+	return d.configValues[bPpFullDataset]->GetBool();
+}
+
+size_t jconf::get_dataset_slots()
+{
+	return d.configValues[iDatasetSlots]->GetUint();
+}
+
+const char* jconf::get_dataset_cache_dir()
+{
+	return d.configValues[sDatasetCacheDir]->GetString();
+}
+
+bool jconf::get_dataset_shared_memory()
+{
+	return d.configValues[bDatasetSharedMem]->GetBool();
+}
+
+bool jconf::get_numa_replicas()
+{
+	return d.configValues[bNumaReplicas]->GetBool();
+}
+
+size_t jconf::get_engine_idle_timeout()
+{
+	return d.configValues[iEngineIdleTimeout]->GetUint();
+}
+
+size_t jconf::get_progpow_item_cache_mb()
+{
+	return d.configValues[iPpItemCacheMb]->GetUint();
+}
+
+size_t jconf::get_client_send_hwm_kb()
+{
+	return d.configValues[iClientSendHwmKb]->GetUint();
+}
+
+size_t jconf::get_verify_thread_count()
+{
+	lpcJsVal val = d.configValues[iVerifyThreads];
+	if(val->IsUint())
+		return val->GetUint();
+
+	/* "auto" */
+	size_t cnt = std::thread::hardware_concurrency();
+	return cnt > 0 ? cnt : 1;
+}
+
+size_t jconf::get_verify_cpu_count()
+{
+	return d.configValues[aVerifyCpuList]->GetArray().Size();
+}
+
+uint32_t jconf::get_verify_cpu(size_t idx)
+{
+	return d.configValues[aVerifyCpuList]->GetArray()[idx].GetUint();
+}
+
+int32_t jconf::get_verify_numa_node()
+{
+	return d.configValues[iVerifyNumaNode]->GetInt();
+}
+
 inline std::string read_file(const char* filename, bool& error)
 {
 	struct stat sb;
@@ -271,5 +344,41 @@ bool jconf::parse_config(const char* filename)
 		return false;
 	}
 
+	lpcJsVal verify_threads = d.configValues[iVerifyThreads];
+	if(!(verify_threads->IsString() && strcmp(verify_threads->GetString(), "auto") == 0) &&
+		!(verify_threads->IsUint() && verify_threads->GetUint() > 0))
+	{
+		fprintf(stderr, "Invalid verify_threads, allowed values are \"auto\" or a positive number.\n");
+		return false;
+	}
+
+	for(const Value& cpu : d.configValues[aVerifyCpuList]->GetArray())
+	{
+		if(!cpu.IsUint())
+		{
+			fprintf(stderr, "Invalid verify_cpu_list, it needs to be a list of CPU numbers.\n");
+			return false;
+		}
+	}
+
+	if(!d.configValues[iVerifyNumaNode]->IsInt())
+	{
+		fprintf(stderr, "Invalid verify_numa_node, use -1 to disable NUMA pinning.\n");
+		return false;
+	}
+
+	/* One full socket buffer has to fit, or any partial write drops the client */
+	if(get_client_send_hwm_kb() < 4)
+	{
+		fprintf(stderr, "Invalid client_send_hwm_kb, it needs to be at least 4.\n");
+		return false;
+	}
+
+	if(get_dataset_slots() < 2)
+	{
+		fprintf(stderr, "Invalid dataset_slots, we need at least 2 (current and next seed / epoch).\n");
+		return false;
+	}
+
 	return true;
 }
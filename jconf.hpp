@@ -68,6 +68,21 @@ public:
 	size_t get_fatal_node_timeout();
 	size_t get_template_timeout();
 
+	bool get_randomx_full_dataset();
+	bool get_progpow_full_dataset();
+	size_t get_dataset_slots();
+	const char* get_dataset_cache_dir();
+	bool get_dataset_shared_memory();
+	bool get_numa_replicas();
+	size_t get_engine_idle_timeout();
+	size_t get_progpow_item_cache_mb();
+	size_t get_client_send_hwm_kb();
+
+	size_t get_verify_thread_count();
+	size_t get_verify_cpu_count();
+	uint32_t get_verify_cpu(size_t idx);
+	int32_t get_verify_numa_node();
+
 private:
 	jconf();
 	class jconfPrivate& d;
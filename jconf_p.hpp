@@ -54,7 +54,19 @@ enum configEnum
 	sTlsCert,
 	sTlsCipers,
 	iTemplateTimeout,
-	iFatalNodeTimeout
+	iFatalNodeTimeout,
+	bRxFullDataset,
+	iVerifyThreads,
+	aVerifyCpuList,
+	iVerifyNumaNode,
+	bPpFullDataset,
+	iDatasetSlots,
+	sDatasetCacheDir,
+	bDatasetSharedMem,
+	bNumaReplicas,
+	iEngineIdleTimeout,
+	iPpItemCacheMb,
+	iClientSendHwmKb
 };
 
 struct configVal
@@ -100,7 +112,19 @@ configVal oConfigValues[] = {
 	{sTlsCert, "tls_certificate", kStringType, flag_none},
 	{sTlsCipers, "tls_ciper_list", kStringType, flag_none},
 	{iTemplateTimeout, "template_timeout", kNumberType, flag_unsigned},
-	{iFatalNodeTimeout, "fatal_node_timeout", kNumberType, flag_unsigned}
+	{iFatalNodeTimeout, "fatal_node_timeout", kNumberType, flag_unsigned},
+	{bRxFullDataset, "randomx_full_dataset", kTrueType, flag_none},
+	{iVerifyThreads, "verify_threads", kNullType, flag_none},
+	{aVerifyCpuList, "verify_cpu_list", kArrayType, flag_none},
+	{iVerifyNumaNode, "verify_numa_node", kNumberType, flag_none},
+	{bPpFullDataset, "progpow_full_dataset", kTrueType, flag_none},
+	{iDatasetSlots, "dataset_slots", kNumberType, flag_unsigned},
+	{sDatasetCacheDir, "dataset_cache_dir", kStringType, flag_none},
+	{bDatasetSharedMem, "dataset_shared_memory", kTrueType, flag_none},
+	{bNumaReplicas, "numa_replicas", kTrueType, flag_none},
+	{iEngineIdleTimeout, "engine_idle_timeout", kNumberType, flag_unsigned},
+	{iPpItemCacheMb, "progpow_item_cache_mb", kNumberType, flag_unsigned},
+	{iClientSendHwmKb, "client_send_hwm_kb", kNumberType, flag_unsigned}
 };
 
 constexpr size_t iConfigCnt = (sizeof(oConfigValues) / sizeof(oConfigValues[0]));
@@ -46,13 +46,19 @@
 
 #include "rx_hashpool.hpp"
 #include "pp_hashpool.hpp"
+#include "dataset_builder.hpp"
 
 node::node() : domAlloc(json_dom_buf, json_buffer_len),
 	parseAlloc(json_parse_buf, json_buffer_len),
 	jsonDoc(&domAlloc, json_buffer_len, &parseAlloc),
-	run_loop(true), sock_fd(-1), current_job(nullptr),
-	last_job_ts(0), logged_in(false)
+	run_loop(true), sock_fd(-1), held_job_ts(0),
+	last_job_ts(0), logged_in(false), last_rx_job_ts(0), last_pp_job_ts(0), rx_active(false), pp_active(false)
 {
+	/* A failed build is retried when the next template reserves the dataset again, the job stays held */
+	dataset_builder::inst().subscribe([this](cache_kind kind, uint64_t id, bool ok) {
+		if(ok)
+			on_dataset_ready(kind, id);
+	});
 }
 
 bool node::node_connect(const char* addr, const char* port)
@@ -110,6 +116,79 @@ void node::thread_main()
 		unix_sleep(1); // Prevent rapid polling on repetivie errors
 	}
 }
+
+/*
+ * A job is only sent to miners once its dataset can verify their shares. If it is still
+ * building, or every slot was busy when it was requested, the job is held (replacing any
+ * older held one) and goes out on the ready event.
+ */
+void node::publish_job(std::shared_ptr<const jobdata> job)
+{
+	/* Checked under the lock the ready event takes, so the event can't slip in between */
+	std::unique_lock<std::mutex> lk(publish_mtx);
+	bool pending = false;
+	cache_kind kind = cache_kind::randomx;
+	uint64_t id = 0;
+	if(job->type == pow_type::randomx)
+	{
+		id = job->rx_seed.get_id();
+		pending = rx_hashpool::inst().is_pending(id);
+	}
+	else if(job->type == pow_type::progpow)
+	{
+		kind = cache_kind::progpow;
+		id = ethash::get_epoch_number(job->height);
+		pending = pp_hashpool::inst().is_pending(id);
+	}
+
+	if(pending)
+	{
+		logger::inst().info("Job held until its ", kind == cache_kind::randomx ? "RandomX" : "ProgPoW", " dataset is ready.");
+		held_job = job;
+		held_job_ts = get_timestamp_ms();
+		return;
+	}
+
+	held_job = nullptr;
+	std::atomic_store(&current_job, job);
+	lk.unlock();
+	server::inst().notify_new_block();
+}
+
+void node::on_dataset_ready(cache_kind kind, uint64_t id)
+{
+	std::unique_lock<std::mutex> lk(publish_mtx);
+	std::shared_ptr<const jobdata> job = held_job;
+	if(job == nullptr)
+		return;
+
+	if(kind == cache_kind::randomx ? job->type != pow_type::randomx || job->rx_seed.get_id() != id :
+		job->type != pow_type::progpow || uint64_t(ethash::get_epoch_number(job->height)) != id)
+		return;
+
+	held_job = nullptr;
+	std::atomic_store(&current_job, job);
+	uint64_t held_ms = get_timestamp_ms() - held_job_ts;
+	lk.unlock();
+
+	logger::inst().info("Job broadcast held ", size_t(held_ms), " ms for its dataset.");
+	server::inst().notify_new_block();
+}
+
+/* Called from the recv loop, so it never races need_dataset / notify_block */
+void node::release_idle_engines()
+{
+	uint64_t idle_timeout_ms = jconf::inst().get_engine_idle_timeout() * 1000;
+	if(idle_timeout_ms == 0)
+		return;
+
+	uint64_t now = get_timestamp_ms();
+	if(rx_active && now - last_rx_job_ts > idle_timeout_ms && rx_hashpool::inst().release_engine())
+		rx_active = false;
+	if(pp_active && now - last_pp_job_ts > idle_timeout_ms && pp_hashpool::inst().release_engine())
+		pp_active = false;
+}
+
 void node::recv_main()
 {
 	int ret;
@@ -119,7 +198,7 @@ void node::recv_main()
 
 	last_job_ts = get_timestamp_ms();
 
-	if(ret <=0 || send(sock_fd, send_buffer, ret, 0) != ret)
+	if(ret <=0 || !send_line(send_buffer, ret))
 		return;
 
 	struct timeval tv;
@@ -130,8 +209,17 @@ void node::recv_main()
 	size_t datalen = 0;
 	uint64_t fatal_node_timeout_ms = jconf::inst().get_fatal_node_timeout() * 1000;
 	uint64_t template_timeout_ms = jconf::inst().get_template_timeout() * 1000;
+	uint64_t idle_check_ts = get_timestamp_ms();
 	while(run_loop)
 	{
+		/* On a clock, a node that keeps talking never lets recv time out */
+		uint64_t now = get_timestamp_ms();
+		if(now - idle_check_ts >= 1000)
+		{
+			release_idle_engines();
+			idle_check_ts = now;
+		}
+
 		ret = recv(sock_fd, recv_buffer + datalen, data_buffer_len - datalen, 0);
 
 		if(ret == -1 && (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK))
@@ -189,10 +277,42 @@ v32 IntArrayToVector(const Value& arr_v)
 	return ret;
 }
 
+void node::send_job_result(const jobdata& data, uint64_t nonce, const v32& powhash)
+{
+	char buffer[1024];
+	const uint8_t* ph = powhash.data;
+	int len = snprintf(buffer, sizeof(buffer), R"({"id":"0","jsonrpc":"2.0","method":"submit","params":)"
+		R"({"height":%u,"job_id":%u,"nonce":%lu,"pow":{"RandomX":)"
+		R"([%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u]}}})""\n",
+		data.height, data.jobid, nonce, 
+		ph[ 0], ph[ 1], ph[ 2], ph[ 3], ph[ 4], ph[ 5], ph[ 6], ph[ 7], ph[ 8], ph[ 9], ph[10], ph[11], ph[12], ph[13], ph[14], ph[15],
+		ph[16], ph[17], ph[18], ph[19], ph[20], ph[21], ph[22], ph[23], ph[24], ph[25], ph[26], ph[27], ph[28], ph[29], ph[30], ph[31]);
+	if(len <= 0 || !send_line(buffer, len))
+		logger::inst().err("Node: Failed to send a block.");
+}
+
+bool node::send_line(const char* buf, size_t len)
+{
+	std::lock_guard<std::mutex> lk(send_mtx);
+	while(len > 0)
+	{
+		ssize_t ret = send(sock_fd, buf, len, 0);
+		if(ret == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
 bool node::send_template_request()
 {
 	const char job_tmpl[] ="{\"id\":\"1\",\"jsonrpc\":\"2.0\",\"method\":\"getjobtemplate\",\"params\":{\"algorithm\":\"randomx\"}}\n";
-	if(send(sock_fd, job_tmpl, sizeof(job_tmpl)-1, 0) != sizeof(job_tmpl)-1)
+	if(!send_line(job_tmpl, sizeof(job_tmpl)-1))
 	{
 		logger::inst().err("Node: Send socket error.");
 		return false;
@@ -312,13 +432,13 @@ ssize_t node::json_proc_msg(char* msg, size_t msglen)
 				return -1;
 			}
 
-			jobs.emplace_back();
-			jobdata* job = &jobs.back();
+			std::shared_ptr<jobdata> job = std::make_shared<jobdata>();
 			job->rx_seed.set_all_zero();
 			job->rx_next_seed.set_all_zero();
 
 			job->type = job_type;
 			job->block_diff = block_diff;
+			job->shares = std::make_shared<share_index>();
 
 			auto epochs = GetArray(GetObjectMemberT(res, "epochs"));
 			if(epochs.Size() != 1 && epochs.Size() != 2)
@@ -339,14 +459,14 @@ ssize_t node::json_proc_msg(char* msg, size_t msglen)
 				{
 					has_our_epoch = true;
 					job->rx_seed = IntArrayToVector(epoch_data[2]);
-					if(!rx_hashpool::inst().has_dataset(job->rx_seed.get_id()))
-						rx_hashpool::inst().calculate_dataset(job->rx_seed);
+					if(job_type == pow_type::randomx)
+						rx_hashpool::inst().need_dataset(job->rx_seed);
 				}
 				else if(height < real_start)
 				{
 					job->rx_next_seed = IntArrayToVector(epoch_data[2]);
-					if(!rx_hashpool::inst().has_dataset(job->rx_next_seed.get_id()))
-						rx_hashpool::inst().calculate_dataset(job->rx_next_seed);
+					if(job_type == pow_type::randomx)
+						rx_hashpool::inst().need_dataset(job->rx_next_seed);
 				}
 				else
 					throw json_parse_error("Unidentfied epoch");
@@ -355,7 +475,18 @@ ssize_t node::json_proc_msg(char* msg, size_t msglen)
 			if(!has_our_epoch)
 				throw json_parse_error("We don't have our epoch");
 
-			pp_hashpool::inst().notify_block(height);
+			/* Engines only come up for the algorithms the node actually sends */
+			if(job_type == pow_type::randomx)
+			{
+				rx_active = true;
+				last_rx_job_ts = get_timestamp_ms();
+			}
+			else if(job_type == pow_type::progpow)
+			{
+				pp_active = true;
+				last_pp_job_ts = get_timestamp_ms();
+				pp_hashpool::inst().notify_block(height);
+			}
 
 			job->jobid = GetJsonUInt(res, "job_id");
 			job->height = height;
@@ -380,12 +511,10 @@ ssize_t node::json_proc_msg(char* msg, size_t msglen)
 				"\nrx_seed: ", job->rx_seed,
 				"\nrx_next_seed: ", job->rx_next_seed);
 
+			/* Miners keep the old job until this one can be verified */
 			last_job_ts = get_timestamp_ms();
-			current_job = job;
-			server::inst().notify_new_block();
-
-			if(jobs.size() > 5)
-				jobs.pop_front();
+			client::build_job_template(*job);
+			publish_job(job);
 
 			return msglen;
 		}
@@ -30,10 +30,12 @@
 #include <thread>
 #include <unordered_map>
 #include <future>
-#include <list>
+#include <memory>
+#include <mutex>
 #include "json.h"
 #include "socks.h"
 #include "workstruct.hpp"
+#include "dataset_cache.hpp"
 
 class node
 {
@@ -46,12 +48,13 @@ public:
 
 	inline bool has_first_job()
 	{
-		return current_job != nullptr;
+		return std::atomic_load(&current_job) != nullptr;
 	}
 
-	jobdata get_current_job()
+	// Shared by every client on it, so a new job costs one allocation instead of one copy per miner
+	std::shared_ptr<const jobdata> get_current_job()
 	{
-		return *current_job;
+		return std::atomic_load(&current_job);
 	}
 
 	void start()
@@ -67,18 +70,8 @@ public:
 		recv_thd.join();
 	}
 
-	void send_job_result(const jobdata& data, uint64_t nonce, const v32& powhash)
-	{
-		char buffer[1024];
-		const uint8_t* ph = powhash.data;
-		int len = snprintf(buffer, sizeof(buffer), R"({"id":"0","jsonrpc":"2.0","method":"submit","params":)"
-			R"({"height":%u,"job_id":%u,"nonce":%lu,"pow":{"RandomX":)"
-			R"([%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u]}}})""\n",
-			data.height, data.jobid, nonce, 
-			ph[ 0], ph[ 1], ph[ 2], ph[ 3], ph[ 4], ph[ 5], ph[ 6], ph[ 7], ph[ 8], ph[ 9], ph[10], ph[11], ph[12], ph[13], ph[14], ph[15],
-			ph[16], ph[17], ph[18], ph[19], ph[20], ph[21], ph[22], ph[23], ph[24], ph[25], ph[26], ph[27], ph[28], ph[29], ph[30], ph[31]);
-		send(sock_fd, buffer, len, 0);
-	}
+	// Called from hash and pool threads
+	void send_job_result(const jobdata& data, uint64_t nonce, const v32& powhash);
 
 private:
 	node();
@@ -89,6 +82,10 @@ private:
 	void thread_main();
 	void recv_main();
 	bool send_template_request();
+	bool send_line(const char* buf, size_t len);
+	void release_idle_engines();
+	void publish_job(std::shared_ptr<const jobdata> job);
+	void on_dataset_ready(cache_kind kind, uint64_t id);
 
 	constexpr static size_t data_buffer_len = 16 * 1024;
 	constexpr static size_t json_buffer_len = 8 * 1024;
@@ -106,11 +103,21 @@ private:
 	std::atomic<bool> run_loop;
 
 	SOCKET sock_fd;
+	std::mutex send_mtx; // One line goes out whole before the next
 
-	std::list<jobdata> jobs;
-	std::atomic<const jobdata*> current_job;
+	std::shared_ptr<const jobdata> current_job; // Only through std::atomic_load / atomic_store
+
+	// Newest job, held back until its dataset is ready. Guarded by publish_mtx, like publishing
+	std::mutex publish_mtx;
+	std::shared_ptr<const jobdata> held_job;
+	uint64_t held_job_ts;
 
 	uint64_t last_job_ts;
 	bool logged_in;
+
+	uint64_t last_rx_job_ts;
+	uint64_t last_pp_job_ts;
+	bool rx_active;
+	bool pp_active;
 };
 
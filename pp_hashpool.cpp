@@ -26,77 +26,466 @@
 // STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-#include "randomx.h"
 #include "pp_hashpool.hpp"
-#include <shared_mutex>
+#include "dataset_cache.hpp"
+#include "cpu_affinity.hpp"
+#include "hugepage_alloc.hpp"
+#include "jconf.hpp"
+#include "stats.hpp"
+#include "time.hpp"
+#include <algorithm>
 #include <string.h>
 
-#include <cpuid.h>
+pp_hashpool::pp_hashpool() : full_mem(jconf::inst().get_progpow_full_dataset()),
+	shared_mem(jconf::inst().get_dataset_shared_memory()),
+	item_cache_bytes((jconf::inst().get_progpow_item_cache_mb() << 20) / (jconf::inst().get_dataset_slots() * get_replica_count())),
+	ds(jconf::inst().get_dataset_slots()),
+	programs_ok(true), self_tested(false), check_ctr(0)
+{
+}
+
+inline bool same_result(const ethash::result& a, const ethash::result& b)
+{
+	return memcmp(a.final_hash.bytes, b.final_hash.bytes, sizeof(a.final_hash.bytes)) == 0 &&
+		memcmp(a.mix_hash.bytes, b.mix_hash.bytes, sizeof(a.mix_hash.bytes)) == 0;
+}
+
+std::shared_ptr<pp_hashpool::cached_program> pp_hashpool::get_program(uint64_t period)
+{
+	std::shared_ptr<cached_program>& slot = programs[period % program_cnt];
+	std::shared_ptr<cached_program> cp = std::atomic_load(&slot);
+	if(cp != nullptr && cp->prog.get_period() == period)
+		return cp;
+
+	/*
+	 * Threads that race here decode the same program and one of them publishes it. A late
+	 * share for an old period gets its program but never evicts a newer one. Hash threads
+	 * still using a replaced program keep their own reference.
+	 */
+	std::shared_ptr<cached_program> fresh = std::make_shared<cached_program>(period);
+	while(cp == nullptr || cp->prog.get_period() < period)
+	{
+		if(std::atomic_compare_exchange_strong(&slot, &cp, fresh))
+			return fresh;
+	}
+	return cp->prog.get_period() == period ? cp : fresh;
+}
 
-pp_hashpool::pp_hashpool() : ds_ctr(0)
+/* The cached program is compared against the library on the first share of its period, then on a sample */
+bool pp_hashpool::check_program(cached_program& cp, const pp_context& ctx, const check_job& job,
+	const ethash::hash256& header_hash, const ethash::result& res)
 {
-	threads.reserve(hash_thd_count);
-	for(size_t i = 0; i < hash_thd_count; i++)
-		threads.emplace_back(&pp_hashpool::hash_thd_main, this);
+	ethash::result ref = ctx.full != nullptr ?
+		progpow::hash(*ctx.full, job.block_number, header_hash, job.nonce) :
+		progpow::hash(*ctx.light, job.block_number, header_hash, job.nonce);
+
+	if(!same_result(ref, res))
+	{
+		logger::inst().err("ProgPoW program cache disagrees with the library in period ", size_t(cp.prog.get_period()),
+			", using the library from now on.");
+		programs_ok = false;
+		return false;
+	}
+
+	cp.checked = true;
+	return true;
 }
 
-void pp_hashpool::hash_thd_main()
+/*
+ * Fixed vectors over a spread of periods, headers and nonces, run against the library once
+ * the first context exists. The checks in hash() only ever see what miners send.
+ */
+void pp_hashpool::self_test(const pp_context& ctx)
 {
-	while(true)
+	constexpr int blocks[] = { 0, 49, 50, 1234, 30000, 459999, 5000000, 123456789 };
+	uint64_t start_ms = get_timestamp_ms();
+
+	for(size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
 	{
-		pp_check_job* job = jobs.pop();
-		uint64_t job_epoch_number = ethash::get_epoch_number(job->block_number);
+		uint64_t seed = 0x9e3779b97f4a7c15ull * (i + 1);
+		ethash::hash256 header_hash = ethash::keccak256(reinterpret_cast<const uint8_t*>(&seed), sizeof(seed));
+		uint64_t nonce = seed ^ uint64_t(blocks[i]);
 
-		size_t dsidx;
-		for(dsidx = 0; dsidx < ds.size(); dsidx++)
+		pp_program prog(uint64_t(blocks[i]) / progpow::period_length);
+		ethash::result res, ref;
+		if(ctx.full != nullptr)
 		{
-			if(ds[dsidx].ready_epoch == job_epoch_number)
-				break;
+			res = prog.hash(*ctx.full, header_hash, nonce);
+			ref = progpow::hash(*ctx.full, blocks[i], header_hash, nonce);
 		}
-
-		if(dsidx == ds.size())
+		else
 		{
-			logger::inst().warn("Precalculated dataset for a job was not found! We lost a share!");
-			job->hash.set_all_ones();
-			job->error = true;
-			job->ready.set_value();
-			continue;
+			res = prog.hash(*ctx.light, nullptr, header_hash, nonce);
+			ref = progpow::hash(*ctx.light, blocks[i], header_hash, nonce);
 		}
 
-		pp_dataset& nds = ds[dsidx];
-		std::shared_lock<std::shared_timed_mutex> lk(nds.mtx);
-		if(nds.ready_epoch != job_epoch_number)
+		if(!same_result(ref, res))
 		{
-			logger::inst().warn("Precalculated dataset was swapped out before we locked. We lost a share!");
-			job->hash.set_all_ones();
-			job->error = true;
-			job->ready.set_value();
-			continue;
+			logger::inst().err("ProgPoW program cache failed test vector ", i, " (block ", blocks[i], "), using the library from now on.");
+			programs_ok = false;
+			return;
 		}
+	}
+
+	logger::inst().info("ProgPoW program cache passed ", sizeof(blocks) / sizeof(blocks[0]), " test vectors in ",
+		size_t(get_timestamp_ms() - start_ms), " ms.");
+}
+
+bool pp_hashpool::release_engine()
+{
+	if(!ds.release_all())
+		return false;
+
+	for(size_t i = 0; i < ds.size(); i++)
+	{
+		stats::inst().pp_dataset_bytes.sub(ds[i].mem_size);
+		ds[i].release();
+	}
+
+	logger::inst().info("ProgPoW engine idle, epoch contexts released.");
+	return true;
+}
+
+void pp_hashpool::hash(check_job* job, size_t replica)
+{
+	/* verify_pool parks jobs until their slot is ready, blocking here would stall a shared worker */
+	if(!ds.is_slot_ready(job->dataset_slot))
+	{
+		logger::inst().err("ProgPoW job reached a worker before its dataset was ready.");
+		job->hash.set_all_ones();
+		job->error = true;
+		return;
+	}
+	pp_dataset& nds = ds[job->dataset_slot];
 
-		ethash_hash256 header_hash = ethash::keccak256(job->data, job->data_len);
+	/* Header excludes the nonce, so it is the same for every share of a job */
+	ethash_hash256 header_hash;
+	if(job->has_header_hash)
+	{
+		memcpy(header_hash.bytes, job->header_hash.data, sizeof(header_hash.bytes));
+	}
+	else
+	{
+		header_hash = ethash::keccak256(job->data, job->data_len);
+		job->header_hash = header_hash.bytes;
+		job->has_header_hash = true;
+	}
 
-		v32 hh = header_hash.bytes;
-		logger::inst().dbglo("Nonce: ", job->nonce, "\nhh: ", hh, "\nbn: ", job->block_number);
-		char blob[1024];
-		bin2hex((uint8_t*)job->data, job->data_len, blob);
-		logger::inst().dbglo("blob len: ", job->data_len, " blob: ", blob);
+	logger::inst().dbglo("Nonce: ", job->nonce, "\nhh: ", job->header_hash, "\nbn: ", job->block_number);
+	char blob[1024];
+	bin2hex((uint8_t*)job->data, job->data_len, blob);
+	logger::inst().dbglo("blob len: ", job->data_len, " blob: ", blob);
 
-		job->res = progpow::hash(*nds.dataset_ptr, job->block_number, header_hash, job->nonce);
-		job->hash = job->res.final_hash.bytes;
+	const pp_context& ctx = nds.ctxs[replica];
+	std::shared_ptr<cached_program> prog;
+	if(programs_ok)
+		prog = get_program(job->block_number / progpow::period_length);
 
-		job->error = false;
-		job->ready.set_value();
+	ethash::result res;
+	if(prog != nullptr)
+	{
+		const pp_program& pp = prog->prog;
+		res = ctx.full != nullptr ? pp.hash(*ctx.full, header_hash, job->nonce) : pp.hash(*ctx.light, ctx.items.get(), header_hash, job->nonce);
+		bool check = !prog->checked.load(std::memory_order_relaxed) ||
+			check_ctr.fetch_add(1, std::memory_order_relaxed) % check_sample_rate == 0;
+		if(check && !check_program(*prog, ctx, *job, header_hash, res))
+			prog = nullptr;
+	}
+
+	if(prog == nullptr)
+	{
+		res = ctx.full != nullptr ?
+			progpow::hash(*ctx.full, job->block_number, header_hash, job->nonce) :
+			progpow::hash(*ctx.light, job->block_number, header_hash, job->nonce);
 	}
+	job->hash = res.final_hash.bytes;
+
+	job->error = false;
 }
 
-void pp_hashpool::dataset_thd_main(size_t ds_idx)
+void pp_hashpool::build_slot(size_t ds_idx)
 {
 	pp_dataset& nds = ds[ds_idx];
-	std::lock_guard<std::shared_timed_mutex> lk(nds.mtx);
-	uint64_t epoch_number = nds.loaded_epoch.load();
-	if(nds.dataset_ptr != nullptr)
-		ethash_destroy_epoch_context(nds.dataset_ptr);
-	nds.dataset_ptr = ethash_create_epoch_context(epoch_number);
-	nds.ready_epoch = epoch_number;
+	uint64_t epoch_number = nds.epoch;
+	uint64_t start_ms = get_timestamp_ms();
+
+	stats::inst().pp_dataset_bytes.sub(nds.mem_size);
+	nds.release();
+
+	bool calculated = false;
+	bool light_calculated = false;
+
+	if(shared_mem)
+	{
+		nds.ctxs.push_back(attach_shared_context(nds, epoch_number, light_calculated));
+		if(full_mem)
+			attach_shared_dataset(nds, epoch_number, calculated);
+	}
+	else if(full_mem)
+	{
+		uint8_t* dag = static_cast<uint8_t*>(hp_alloc(ethash::get_full_dataset_size(ethash::calculate_full_dataset_num_items(epoch_number)),
+			"ProgPoW full dataset"));
+		if(dag == nullptr)
+		{
+			logger::inst().err("Failed to allocate ProgPoW full dataset (not enough RAM).");
+			exit(1);
+		}
+		nds.ctxs.push_back(make_context(epoch_number, nullptr, dag, light_calculated));
+		nds.ctxs[0].dag = dag;
+		calculated = !load_full_dataset(*nds.ctxs[0].full, epoch_number);
+		if(calculated)
+			init_full_dataset_mt(*nds.ctxs[0].full);
+	}
+	else
+		nds.ctxs.push_back(make_context(epoch_number, nullptr, nullptr, light_calculated));
+
+	if(get_replica_count() > 1)
+		replicate_dataset(nds, epoch_number);
+
+	/* Before the first slot is ready, so no share relies on an untested program */
+	if(!self_tested.exchange(true))
+		self_test(nds.ctxs[0]);
+
+	const ethash::epoch_context& ctx = nds.ctxs[0].get();
+	uint64_t light_size = ethash::get_light_cache_size(ctx.light_cache_num_items) + progpow::l1_cache_size;
+	uint64_t full_size = full_mem ? ethash::get_full_dataset_size(ctx.full_dataset_num_items) : 0;
+	nds.mem_size = (light_size + full_size) * get_replica_count();
+	for(const pp_context& c : nds.ctxs)
+		nds.mem_size += c.items != nullptr ? c.items->get_mem_size() : 0;
+	stats::inst().pp_dataset_bytes.add(nds.mem_size);
+
+	logger::inst().info("ProgPoW epoch ", size_t(epoch_number), " ready in ", size_t(get_timestamp_ms() - start_ms), " ms. Light cache: ",
+		size_t(light_size >> 20), " MiB, full DAG: ", size_t(full_size >> 20), " MiB");
+
+	ds.set_ready(ds_idx);
+	dataset_builder::inst().notify_ready(cache_kind::progpow, epoch_number);
+
+	if((calculated || light_calculated) && dataset_cache::inst().enabled())
+	{
+		/* Hold a reference while writing, so the slot isn't recycled under us */
+		size_t idx = ds.acquire(epoch_number);
+		if(idx == ds_idx)
+		{
+			v32 key;
+			key.set_all_zero();
+			if(light_calculated)
+				dataset_cache::inst().store(cache_kind::progpow_light, epoch_number, key, reinterpret_cast<const uint8_t*>(ctx.light_cache),
+					ethash::get_light_cache_size(ctx.light_cache_num_items));
+			if(calculated)
+				dataset_cache::inst().store(cache_kind::progpow, epoch_number, key, reinterpret_cast<const uint8_t*>(nds.ctxs[0].full->full_dataset), full_size);
+		}
+		if(idx != ds.npos)
+			ds.release(idx);
+	}
+}
+
+static ethash::epoch_context_full* make_full(const ethash::epoch_context& light, uint8_t* dag)
+{
+	return new ethash::epoch_context_full(light.epoch_number, light.light_cache_num_items, light.light_cache,
+		light.l1_cache, light.full_dataset_num_items, reinterpret_cast<ethash_hash1024*>(dag));
+}
+
+inline size_t light_mem_size(uint64_t epoch_number)
+{
+	return ethash::get_light_cache_size(ethash::calculate_light_cache_num_items(int(epoch_number))) + progpow::l1_cache_size;
+}
+
+/* Light context over mem, which holds the light cache followed by the L1 cache */
+static ethash::epoch_context* make_light(uint64_t epoch_number, const uint8_t* mem)
+{
+	int epoch = int(epoch_number);
+	int light_items = ethash::calculate_light_cache_num_items(epoch);
+	const uint32_t* l1 = reinterpret_cast<const uint32_t*>(mem + ethash::get_light_cache_size(light_items));
+	return new ethash::epoch_context{epoch, light_items, reinterpret_cast<const ethash::hash512*>(mem), l1,
+		ethash::calculate_full_dataset_num_items(epoch)};
+}
+
+/* Fills the memory behind light from the disk cache, else has ethash generate it. Returns true if it was generated */
+static bool build_light(const ethash::epoch_context& light, uint8_t* mem)
+{
+	size_t light_size = ethash::get_light_cache_size(light.light_cache_num_items);
+	uint32_t* l1 = reinterpret_cast<uint32_t*>(mem + light_size);
+
+	v32 key;
+	key.set_all_zero();
+	if(dataset_cache::inst().load(cache_kind::progpow_light, light.epoch_number, key, mem, light_size))
+	{
+		/* ethash fills the L1 cache with the first dataset items, which only read the light cache */
+		ethash::hash2048* items = reinterpret_cast<ethash::hash2048*>(l1);
+		for(uint32_t i = 0; i < progpow::l1_cache_size / sizeof(ethash::hash2048); i++)
+			items[i] = ethash::calculate_dataset_item_2048(light, i);
+		return false;
+	}
+
+	ethash::epoch_context* gen = ethash_create_epoch_context(light.epoch_number);
+	if(gen == nullptr)
+	{
+		logger::inst().err("Failed to allocate ProgPoW light cache (not enough RAM).");
+		exit(1);
+	}
+
+	memcpy(mem, gen->light_cache, light_size);
+	memcpy(l1, gen->l1_cache, progpow::l1_cache_size);
+	ethash_destroy_epoch_context(gen);
+	return true;
+}
+
+/*
+ * Light cache and L1 cache in one owned block, copied from src if given, else loaded from the disk
+ * cache, else generated by ethash. In full mode the context is a shell that reads the DAG from dag.
+ */
+pp_context pp_hashpool::make_context(uint64_t epoch_number, const pp_context* src, uint8_t* dag, bool& light_calculated)
+{
+	size_t mem_len = light_mem_size(epoch_number);
+
+	pp_context ctx = {};
+	ctx.light_mem = static_cast<uint8_t*>(hp_alloc(mem_len, "ProgPoW light cache"));
+	if(ctx.light_mem == nullptr)
+	{
+		logger::inst().err("Failed to allocate ProgPoW light cache (not enough RAM).");
+		exit(1);
+	}
+	ctx.light = make_light(epoch_number, ctx.light_mem);
+
+	light_calculated = false;
+	if(src != nullptr)
+		memcpy(ctx.light_mem, src->light_mem, mem_len);
+	else
+		light_calculated = build_light(*ctx.light, ctx.light_mem);
+
+	if(dag != nullptr)
+		ctx.full = make_full(*ctx.light, dag);
+	else if(!full_mem && item_cache_bytes > 0)
+		ctx.items.reset(new pp_item_cache(item_cache_bytes));
+	return ctx;
+}
+
+/*
+ * Every NUMA node gets its own context, created by a thread running on that node so
+ * first touch puts the memory there. Light caches and full DAGs are copied over rather than rebuilt.
+ * Replica 0 was filled by the builder threads wherever they ran, so it is moved.
+ */
+void pp_hashpool::replicate_dataset(pp_dataset& nds, uint64_t epoch_number)
+{
+	const std::vector<uint32_t>& nodes = get_replica_nodes();
+	uint64_t start_ms = get_timestamp_ms();
+
+	const ethash::epoch_context& light = *nds.ctxs[0].light;
+	bind_memory_to_node(nds.ctxs[0].light_mem, ethash::get_light_cache_size(light.light_cache_num_items) + progpow::l1_cache_size, nodes[0]);
+	if(nds.ctxs[0].dag != nullptr)
+		bind_memory_to_node(nds.ctxs[0].dag, ethash::get_full_dataset_size(light.full_dataset_num_items), nodes[0]);
+
+	nds.ctxs.resize(nodes.size());
+	std::vector<std::thread> thds;
+	thds.reserve(nodes.size() - 1);
+	for(size_t r = 1; r < nodes.size(); r++)
+	{
+		thds.emplace_back([this, &nds, &nodes, r, epoch_number]() {
+			pin_current_thread_to_node(nodes[r]);
+			const pp_context& src = nds.ctxs[0];
+			bool light_calculated;
+			if(src.full == nullptr)
+			{
+				nds.ctxs[r] = make_context(epoch_number, &src, nullptr, light_calculated);
+				return;
+			}
+
+			size_t full_size = ethash::get_full_dataset_size(src.full->full_dataset_num_items);
+			uint8_t* dag = static_cast<uint8_t*>(hp_alloc(full_size, "ProgPoW full dataset replica"));
+			if(dag == nullptr)
+			{
+				logger::inst().err("Failed to allocate ProgPoW full dataset replica (not enough RAM).");
+				exit(1);
+			}
+			memcpy(dag, src.full->full_dataset, full_size);
+			nds.ctxs[r] = make_context(epoch_number, &src, dag, light_calculated);
+			nds.ctxs[r].dag = dag;
+		});
+	}
+
+	for(std::thread& thd : thds)
+		thd.join();
+
+	logger::inst().info("ProgPoW epoch ", size_t(epoch_number), " replicated to ", nodes.size(), " NUMA nodes in ",
+		size_t(get_timestamp_ms() - start_ms), " ms.");
+}
+
+/* Light and L1 caches from shared memory, built by whoever needs them first */
+pp_context pp_hashpool::attach_shared_context(pp_dataset& nds, uint64_t epoch_number, bool& light_calculated)
+{
+	uint8_t* mem = nds.light_shm.attach(cache_kind::progpow_light, epoch_number, light_mem_size(epoch_number),
+		[&](uint8_t* mem) {
+			std::unique_ptr<ethash::epoch_context> light(make_light(epoch_number, mem));
+			light_calculated = build_light(*light, mem);
+		});
+
+	if(mem == nullptr)
+	{
+		logger::inst().err("Failed to attach shared ProgPoW light cache.");
+		exit(1);
+	}
+
+	pp_context ctx = {};
+	ctx.light = make_light(epoch_number, mem);
+	if(!full_mem && item_cache_bytes > 0)
+		ctx.items.reset(new pp_item_cache(item_cache_bytes));
+	return ctx;
+}
+
+/* Full mode only, the DAG comes from shared memory and is built by whoever needs it first */
+void pp_hashpool::attach_shared_dataset(pp_dataset& nds, uint64_t epoch_number, bool& calculated)
+{
+	size_t full_size = ethash::get_full_dataset_size(ethash::calculate_full_dataset_num_items(epoch_number));
+	pp_context& ctx = nds.ctxs[0];
+
+	uint8_t* mem = nds.shm.attach(cache_kind::progpow, epoch_number, full_size,
+		[&](uint8_t* mem) {
+			ctx.full = make_full(*ctx.light, mem);
+			calculated = !load_full_dataset(*ctx.full, epoch_number);
+			if(calculated)
+				init_full_dataset_mt(*ctx.full);
+		});
+
+	if(mem == nullptr)
+	{
+		logger::inst().err("Failed to attach shared ProgPoW full dataset.");
+		exit(1);
+	}
+
+	if(ctx.full == nullptr)
+		ctx.full = make_full(*ctx.light, mem);
+}
+
+/* DAG from the disk cache, spot checked against the light cache on top of the file checksum */
+bool pp_hashpool::load_full_dataset(ethash::epoch_context_full& ctx, uint64_t epoch_number)
+{
+	constexpr uint32_t spot_check_cnt = 16;
+
+	uint32_t item_cnt = ctx.full_dataset_num_items;
+	v32 key;
+	key.set_all_zero();
+	if(!dataset_cache::inst().load(cache_kind::progpow, epoch_number, key, reinterpret_cast<uint8_t*>(ctx.full_dataset),
+		ethash::get_full_dataset_size(item_cnt)))
+		return false;
+
+	for(uint32_t i = 0; i < spot_check_cnt; i++)
+	{
+		uint32_t idx = uint64_t(item_cnt - 1) * i / (spot_check_cnt - 1);
+		ethash::hash1024 item = ethash::calculate_dataset_item_1024(ctx, idx);
+		if(memcmp(&item, &ctx.full_dataset[idx], sizeof(item)) != 0)
+		{
+			logger::inst().warn("ProgPoW DAG from the disk cache failed the spot check, rebuilding it.");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Fill every DAG item up front, so the hash threads never take the lazy path */
+void pp_hashpool::init_full_dataset_mt(ethash::epoch_context_full& ctx)
+{
+	dataset_builder::inst().parallel_for("ProgPoW DAG", ctx.full_dataset_num_items, [&ctx](uint64_t first, uint64_t cnt) {
+		for(uint64_t j = first; j < first + cnt; j++)
+			ctx.full_dataset[j] = ethash::calculate_dataset_item_1024(ctx, uint32_t(j));
+	});
 }
@@ -27,25 +27,46 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
-#include <shared_mutex>
 #include <atomic>
-#include <condition_variable>
-#include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "ethash/keccak.hpp"
 #include "ethash/progpow.hpp"
+#include "ethash/ethash-internal.hpp"
 #include "vector32.h"
-#include "thdq.hpp"
 #include "log.hpp"
 #include "check_job.hpp"
+#include "dataset_slots.hpp"
+#include "dataset_builder.hpp"
+#include "shm_dataset.hpp"
+#include "hugepage_alloc.hpp"
+#include "pp_program.hpp"
 
 constexpr uint64_t invalid_epoch = uint64_t(-1);
 
+/*
+ * One NUMA replica of an epoch. The light context reads the light and L1 caches from
+ * light_mem or, with shared memory, from the segment in pp_dataset::light_shm. In full
+ * DAG mode full is a shell over it that reads the DAG from dag (huge page layer) or,
+ * with shared memory, from the segment in pp_dataset::shm.
+ */
+struct pp_context
+{
+	ethash::epoch_context* light;
+	ethash::epoch_context_full* full;
+	uint8_t* light_mem; // Owned, light cache followed by the L1 cache, light points into it. nullptr when shared
+	uint8_t* dag; // Owned, nullptr with a shared DAG
+	std::unique_ptr<pp_item_cache> items; // Light mode only, if "progpow_item_cache_mb" allows
+
+	inline const ethash::epoch_context& get() const { return full != nullptr ? *full : *light; }
+};
+
 struct pp_dataset
 {
-	pp_dataset() : loaded_epoch(invalid_epoch), ready_epoch(invalid_epoch), dataset_ptr(nullptr)
+	pp_dataset() : epoch(invalid_epoch), mem_size(0)
 	{
 	}
 
@@ -56,33 +77,35 @@ struct pp_dataset
 
 	~pp_dataset()
 	{
-		if(dataset_ptr != nullptr)
-			ethash_destroy_epoch_context(dataset_ptr);
+		release();
+	}
+
+	void release()
+	{
+		for(pp_context& ctx : ctxs)
+		{
+			delete ctx.full;
+			delete ctx.light;
+			hp_free(ctx.dag);
+			hp_free(ctx.light_mem);
+		}
+		ctxs.clear();
+		shm.detach();
+		light_shm.detach();
+		mem_size = 0;
 	}
 
-	/* 
-	 * loaded_seed_id - seed id calculating or ready (or zero)
-	 * ready_seed_id - seed id that is ready (or zero), set after calculation
-	 */
-	std::atomic<uint64_t> loaded_epoch;
-	std::atomic<uint64_t> ready_epoch;
-	std::shared_timed_mutex mtx;
-	ethash::epoch_context* dataset_ptr;
+	uint64_t epoch;
+	std::vector<pp_context> ctxs; // Indexed by NUMA replica
+	shm_dataset shm; // Full DAG
+	shm_dataset light_shm; // Light and L1 caches
+	uint64_t mem_size;
 };
 
 class pp_hashpool
 {
 public:
 	constexpr static size_t hash_len = 32;
-	constexpr static size_t hash_thd_count = 2;
-
-	struct pp_check_job : public check_job
-	{
-		std::promise<void> ready;
-		uint64_t nonce;
-		uint64_t block_number;
-		ethash::result res;
-	};
 
 	inline static pp_hashpool& inst()
 	{
@@ -90,46 +113,78 @@ public:
 		return inst;
 	};
 
-	inline void push_job(pp_check_job& job) { jobs.push(&job); }
+	void hash(check_job* job, size_t replica);
 
 	inline void notify_block(uint64_t block_number)
 	{
 		notify_epoch(ethash::get_epoch_number(block_number));
 		notify_epoch(ethash::get_epoch_number(block_number+1));
+		get_program(block_number / progpow::period_length);
+		get_program((block_number+1) / progpow::period_length);
 	}
 
-private:
-	inline void notify_epoch(uint64_t epoch_number)
+	// True while the epoch can't be used yet, dataset_builder fires an event once it can
+	inline bool is_pending(uint64_t epoch_number) { return ds.is_pending(epoch_number); }
+
+	// Pins the job's epoch until release(), false if it was never requested
+	inline bool acquire(check_job& job)
 	{
-		if(!has_dataset(epoch_number))
-		{
-			size_t i = ds_ctr.fetch_add(1) % ds.size();
-			ds[i].ready_epoch = invalid_epoch;
-			ds[i].loaded_epoch = epoch_number;
-			std::thread thd(&pp_hashpool::dataset_thd_main, this, i);
-			thd.detach();
-		}
+		job.dataset_slot = ds.acquire(job.dataset_id);
+		return job.dataset_slot != ds.npos;
 	}
 
-	inline bool has_dataset(uint64_t epoch_number)
+	inline void release(check_job& job) { ds.release(job.dataset_slot); }
+	inline bool is_ready(check_job& job) { return ds.is_slot_ready(job.dataset_slot); }
+	inline bool is_failed(check_job& job) { return ds.is_slot_failed(job.dataset_slot); }
+
+	// Frees every epoch context if nothing is in flight, false if there was nothing to free
+	bool release_engine();
+
+private:
+	inline void notify_epoch(uint64_t epoch_number)
 	{
-		for(pp_dataset& hay : ds)
-		{
-			if(epoch_number == hay.loaded_epoch)
-				return true;
-		}
-		return false;
+		size_t i = ds.reserve(epoch_number);
+		if(i == ds.npos)
+			return;
+		ds[i].epoch = epoch_number;
+		dataset_builder::inst().submit(cache_kind::progpow, epoch_number, [this, i]() { build_slot(i); },
+			[this, i]() { ds.set_failed(i); });
 	}
 
-	pp_hashpool();
+	// Current, next and a couple of stale periods for late shares, slot is period % program_cnt
+	constexpr static size_t program_cnt = 4;
+	// After its first share a program is still compared against the library on one share in this many
+	constexpr static uint64_t check_sample_rate = 256;
 
-	void dataset_thd_main(size_t ds_idx);
-	void hash_thd_main();
+	struct cached_program
+	{
+		explicit cached_program(uint64_t period) : prog(period), checked(false) {}
 
-	std::array<pp_dataset, 2> ds;
-	std::atomic<size_t> ds_ctr;
+		pp_program prog;
+		std::atomic<bool> checked; // Matched the library once
+	};
+
+	pp_hashpool();
 
-	thdq<pp_check_job*> jobs;
-	std::vector<std::thread> threads;
-	
+	std::shared_ptr<cached_program> get_program(uint64_t period);
+	bool check_program(cached_program& cp, const pp_context& ctx, const check_job& job,
+		const ethash::hash256& header_hash, const ethash::result& res);
+	void self_test(const pp_context& ctx);
+	void build_slot(size_t ds_idx);
+	void init_full_dataset_mt(ethash::epoch_context_full& ctx);
+	bool load_full_dataset(ethash::epoch_context_full& ctx, uint64_t epoch_number);
+	void replicate_dataset(pp_dataset& nds, uint64_t epoch_number);
+	pp_context make_context(uint64_t epoch_number, const pp_context* src, uint8_t* dag, bool& light_calculated);
+	pp_context attach_shared_context(pp_dataset& nds, uint64_t epoch_number, bool& light_calculated);
+	void attach_shared_dataset(pp_dataset& nds, uint64_t epoch_number, bool& calculated);
+
+	bool full_mem;
+	bool shared_mem;
+	size_t item_cache_bytes; // Per epoch context, the budget is split over slots and replicas
+	dataset_slots<pp_dataset> ds;
+
+	std::shared_ptr<cached_program> programs[program_cnt]; // Only through std::atomic_load / atomic_compare_exchange
+	std::atomic<bool> programs_ok; // Cleared for good on a mismatch, we fall back to progpow::hash
+	std::atomic<bool> self_tested;
+	std::atomic<uint64_t> check_ctr;
 };
@@ -0,0 +1,132 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "pp_item_cache.hpp"
+#include "hugepage_alloc.hpp"
+
+#include <new>
+#include <string.h>
+
+pp_item_cache::pp_item_cache(size_t budget_bytes) : entries(nullptr), set_cnt(0), tick(0)
+{
+	size_t max_sets = budget_bytes / (ways * sizeof(entry));
+	if(max_sets == 0)
+		return;
+
+	set_cnt = 1;
+	while(set_cnt * 2 <= max_sets)
+		set_cnt *= 2;
+
+	entries = static_cast<entry*>(hp_alloc(get_mem_size(), "ProgPoW item cache"));
+	if(entries == nullptr)
+	{
+		set_cnt = 0;
+		return;
+	}
+
+	for(size_t i = 0; i < set_cnt * ways; i++)
+		new(&entries[i]) entry();
+}
+
+pp_item_cache::~pp_item_cache()
+{
+	if(entries == nullptr)
+		return;
+
+	for(size_t i = 0; i < set_cnt * ways; i++)
+		entries[i].~entry();
+	hp_free(entries);
+}
+
+bool pp_item_cache::try_read(entry& e, uint32_t index, ethash::hash2048& out)
+{
+	uint64_t s1 = e.seq.load(std::memory_order_acquire);
+	if((s1 >> 32) != uint64_t(index) + 1 || (s1 & 1) != 0)
+		return false;
+
+	memcpy(&out, &e.item, sizeof(out));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return e.seq.load(std::memory_order_relaxed) == s1;
+}
+
+void pp_item_cache::insert(entry* set, uint32_t index, const ethash::hash2048& item)
+{
+	/* Least recently used way that no one is writing */
+	entry* victim = nullptr;
+	uint64_t victim_seq = 0;
+	for(size_t w = 0; w < ways; w++)
+	{
+		uint64_t s = set[w].seq.load(std::memory_order_relaxed);
+		if((s & 1) != 0)
+			continue;
+		if(victim == nullptr || set[w].last_used.load(std::memory_order_relaxed) < victim->last_used.load(std::memory_order_relaxed))
+		{
+			victim = &set[w];
+			victim_seq = s;
+		}
+	}
+
+	if(victim == nullptr)
+		return;
+
+	uint64_t tag = (uint64_t(index) + 1) << 32;
+	uint32_t version = uint32_t(victim_seq) + 1;
+	if(!victim->seq.compare_exchange_strong(victim_seq, tag | version, std::memory_order_acquire))
+		return;
+	std::atomic_thread_fence(std::memory_order_release);
+
+	memcpy(&victim->item, &item, sizeof(item));
+	victim->last_used.store(tick.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	victim->seq.store(tag | uint32_t(version + 1), std::memory_order_release);
+}
+
+ethash::hash2048 pp_item_cache::lookup(const ethash::epoch_context& ctx, uint32_t index, bool& hit)
+{
+	ethash::hash2048 item;
+	if(entries == nullptr)
+	{
+		hit = false;
+		return ethash::calculate_dataset_item_2048(ctx, index);
+	}
+
+	entry* set = &entries[(index & (set_cnt - 1)) * ways];
+	for(size_t w = 0; w < ways; w++)
+	{
+		if(try_read(set[w], index, item))
+		{
+			set[w].last_used.store(tick.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			hit = true;
+			return item;
+		}
+	}
+
+	hit = false;
+	item = ethash::calculate_dataset_item_2048(ctx, index);
+	insert(set, index, item);
+	return item;
+}
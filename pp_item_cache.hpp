@@ -0,0 +1,79 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <atomic>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "ethash/ethash-internal.hpp"
+
+/*
+ * Bounded cache of 2048-bit DAG items for a light mode epoch context, the middle
+ * ground between deriving every item from the light cache and a full DAG. It is
+ * 4-way set associative with approximate LRU inside a set, and every set is its
+ * own shard: lookups take no locks, entries are guarded by a seqlock, and a writer
+ * that loses the race for an entry simply doesn't cache its item.
+ */
+class pp_item_cache
+{
+public:
+	// Rounds down to a power of two number of sets, budget_bytes too small gives a disabled cache
+	explicit pp_item_cache(size_t budget_bytes);
+	~pp_item_cache();
+
+	pp_item_cache(const pp_item_cache& r) = delete;
+	pp_item_cache& operator=(const pp_item_cache& r) = delete;
+
+	inline size_t get_mem_size() const { return set_cnt * ways * sizeof(entry); }
+
+	// Item index of ctx, calculated on a miss. hit is set accordingly
+	ethash::hash2048 lookup(const ethash::epoch_context& ctx, uint32_t index, bool& hit);
+
+private:
+	constexpr static size_t ways = 4;
+
+	/*
+	 * seq holds index + 1 in the high half (0 is empty) and a version in the low half,
+	 * odd while a writer is filling item.
+	 */
+	struct alignas(64) entry
+	{
+		entry() : seq(0), last_used(0) {}
+
+		std::atomic<uint64_t> seq;
+		std::atomic<uint32_t> last_used;
+		ethash::hash2048 item;
+	};
+
+	bool try_read(entry& e, uint32_t index, ethash::hash2048& out);
+	void insert(entry* set, uint32_t index, const ethash::hash2048& item);
+
+	entry* entries;
+	size_t set_cnt;
+	std::atomic<uint32_t> tick;
+};
@@ -0,0 +1,355 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "pp_program.hpp"
+#include "ethash/keccak.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <string.h>
+#include <utility>
+
+/* Same primitives as the library's ProgPoW, this file must stay bit exact with it */
+constexpr uint32_t fnv_prime = 0x01000193;
+constexpr uint32_t fnv_offset_basis = 0x811c9dc5;
+
+inline uint32_t fnv1a(uint32_t u, uint32_t v)
+{
+	return (u ^ v) * fnv_prime;
+}
+
+inline uint32_t rotl32(uint32_t n, uint32_t c)
+{
+	c &= 31;
+	return (n << c) | (n >> ((32 - c) & 31));
+}
+
+inline uint32_t rotr32(uint32_t n, uint32_t c)
+{
+	c &= 31;
+	return (n >> c) | (n << ((32 - c) & 31));
+}
+
+inline uint32_t clz32(uint32_t x)
+{
+	return x == 0 ? 32 : __builtin_clz(x);
+}
+
+class kiss99
+{
+public:
+	kiss99(uint32_t z, uint32_t w, uint32_t jsr, uint32_t jcong) : z(z), w(w), jsr(jsr), jcong(jcong) {}
+
+	inline uint32_t operator()()
+	{
+		z = 36969 * (z & 0xffff) + (z >> 16);
+		w = 18000 * (w & 0xffff) + (w >> 16);
+		jcong = 69069 * jcong + 1234567;
+		jsr ^= (jsr << 17);
+		jsr ^= (jsr >> 13);
+		jsr ^= (jsr << 5);
+		return (((z << 16) + w) ^ jcong) + jsr;
+	}
+
+private:
+	uint32_t z, w, jsr, jcong;
+};
+
+/* keccak-f[800] over header, nonce / seed and mix, no padding */
+static ethash::hash256 keccak_progpow_256(const ethash::hash256& header_hash, uint64_t nonce, const ethash::hash256& mix_hash)
+{
+	uint32_t state[25] = {0};
+	size_t i = 0;
+	for(uint32_t w : header_hash.word32s)
+		state[i++] = w;
+	state[i++] = uint32_t(nonce);
+	state[i++] = uint32_t(nonce >> 32);
+	for(uint32_t w : mix_hash.word32s)
+		state[i++] = w;
+
+	ethash_keccakf800(state);
+
+	ethash::hash256 out;
+	memcpy(out.word32s, state, sizeof(out.word32s));
+	return out;
+}
+
+inline uint64_t keccak_progpow_64(const ethash::hash256& header_hash, uint64_t nonce)
+{
+	ethash::hash256 zero;
+	memset(&zero, 0, sizeof(zero));
+	return __builtin_bswap64(keccak_progpow_256(header_hash, nonce, zero).word64s[0]);
+}
+
+/* Full DAG, items the builder hasn't filled yet are calculated on the spot like the library does */
+struct full_lookup
+{
+	inline ethash::hash2048 operator()(uint32_t index)
+	{
+		ethash::hash2048& item = reinterpret_cast<ethash::hash2048*>(ctx.full_dataset)[index];
+		if(item.word64s[0] == 0)
+			item = ethash::calculate_dataset_item_2048(ctx, index);
+		return item;
+	}
+
+	const ethash::epoch_context_full& ctx;
+};
+
+struct light_lookup
+{
+	inline ethash::hash2048 operator()(uint32_t index)
+	{
+		return ethash::calculate_dataset_item_2048(ctx, index);
+	}
+
+	const ethash::epoch_context& ctx;
+};
+
+/* Hits are counted locally and added to the stats once per hash */
+struct cached_lookup
+{
+	inline ethash::hash2048 operator()(uint32_t index)
+	{
+		bool hit;
+		ethash::hash2048 item = items.lookup(ctx, index, hit);
+		hits += hit ? 1 : 0;
+		return item;
+	}
+
+	const ethash::epoch_context& ctx;
+	pp_item_cache& items;
+	uint64_t hits;
+};
+
+pp_program::merge_op pp_program::decode_merge(uint32_t sel)
+{
+	return { sel % 4, (sel >> 16) % 31 + 1 };
+}
+
+/* Draws the period's random numbers in exactly the order a library round does */
+pp_program::pp_program(uint64_t period) : period(period)
+{
+	using namespace progpow;
+
+	uint32_t seed_lo = uint32_t(period);
+	uint32_t seed_hi = uint32_t(period >> 32);
+	uint32_t z = fnv1a(fnv_offset_basis, seed_lo);
+	uint32_t w = fnv1a(z, seed_hi);
+	uint32_t jsr = fnv1a(w, seed_lo);
+	uint32_t jcong = fnv1a(jsr, seed_hi);
+	kiss99 rng(z, w, jsr, jcong);
+
+	/* Fisher-Yates shuffled register sequences */
+	uint32_t dst_seq[num_regs];
+	uint32_t src_seq[num_regs];
+	for(uint32_t i = 0; i < num_regs; i++)
+	{
+		dst_seq[i] = i;
+		src_seq[i] = i;
+	}
+	for(uint32_t i = num_regs; i > 1; i--)
+	{
+		std::swap(dst_seq[i - 1], dst_seq[rng() % i]);
+		std::swap(src_seq[i - 1], src_seq[rng() % i]);
+	}
+
+	size_t dst_ctr = 0;
+	size_t src_ctr = 0;
+	for(int i = 0; i < max_operations; i++)
+	{
+		if(i < num_cache_accesses)
+		{
+			cache_op& op = cache_ops[i];
+			op.src = src_seq[(src_ctr++) % num_regs];
+			op.dst = dst_seq[(dst_ctr++) % num_regs];
+			op.merge = decode_merge(rng());
+		}
+		if(i < num_math_operations)
+		{
+			math_op& op = math_ops[i];
+			uint32_t src_rnd = rng() % (num_regs * (num_regs - 1));
+			op.src1 = src_rnd % num_regs;
+			op.src2 = src_rnd / num_regs;
+			if(op.src2 >= op.src1)
+				op.src2++;
+			op.kind = rng() % 11;
+			op.dst = dst_seq[(dst_ctr++) % num_regs];
+			op.merge = decode_merge(rng());
+		}
+	}
+
+	for(size_t i = 0; i < words_per_lane; i++)
+	{
+		dag_dsts[i] = i == 0 ? 0 : dst_seq[(dst_ctr++) % num_regs];
+		dag_merges[i] = decode_merge(rng());
+	}
+}
+
+inline uint32_t random_math(uint32_t a, uint32_t b, uint32_t kind)
+{
+	switch(kind)
+	{
+	default:
+	case 0:
+		return a + b;
+	case 1:
+		return a * b;
+	case 2:
+		return uint32_t((uint64_t(a) * b) >> 32);
+	case 3:
+		return std::min(a, b);
+	case 4:
+		return rotl32(a, b);
+	case 5:
+		return rotr32(a, b);
+	case 6:
+		return a & b;
+	case 7:
+		return a | b;
+	case 8:
+		return a ^ b;
+	case 9:
+		return clz32(a) + clz32(b);
+	case 10:
+		return __builtin_popcount(a) + __builtin_popcount(b);
+	}
+}
+
+template<typename merge_op>
+inline void random_merge(uint32_t& a, uint32_t b, const merge_op& op)
+{
+	switch(op.kind)
+	{
+	case 0:
+		a = (a * 33) + b;
+		break;
+	case 1:
+		a = (a ^ b) * 33;
+		break;
+	case 2:
+		a = rotl32(a, op.rot) ^ b;
+		break;
+	case 3:
+		a = rotr32(a, op.rot) ^ b;
+		break;
+	}
+}
+
+template<typename lookup_t>
+void pp_program::round(const ethash::epoch_context& ctx, uint32_t r, mix_array& mix, lookup_t& lookup) const
+{
+	using namespace progpow;
+
+	uint32_t num_items = uint32_t(ctx.full_dataset_num_items / 2);
+	ethash::hash2048 item = lookup(mix[r % num_lanes][0] % num_items);
+
+	for(int i = 0; i < max_operations; i++)
+	{
+		if(i < num_cache_accesses)
+		{
+			const cache_op& op = cache_ops[i];
+			for(size_t l = 0; l < num_lanes; l++)
+				random_merge(mix[l][op.dst], ctx.l1_cache[mix[l][op.src] % l1_cache_num_items], op.merge);
+		}
+		if(i < num_math_operations)
+		{
+			const math_op& op = math_ops[i];
+			for(size_t l = 0; l < num_lanes; l++)
+				random_merge(mix[l][op.dst], random_math(mix[l][op.src1], mix[l][op.src2], op.kind), op.merge);
+		}
+	}
+
+	for(size_t l = 0; l < num_lanes; l++)
+	{
+		size_t offset = ((l ^ r) % num_lanes) * words_per_lane;
+		for(size_t i = 0; i < words_per_lane; i++)
+			random_merge(mix[l][dag_dsts[i]], item.word32s[offset + i], dag_merges[i]);
+	}
+}
+
+template<typename lookup_t>
+ethash::hash256 pp_program::hash_mix(const ethash::epoch_context& ctx, uint64_t seed, lookup_t& lookup) const
+{
+	using namespace progpow;
+
+	mix_array mix;
+	uint32_t z = fnv1a(fnv_offset_basis, uint32_t(seed));
+	uint32_t w = fnv1a(z, uint32_t(seed >> 32));
+	for(uint32_t l = 0; l < num_lanes; l++)
+	{
+		uint32_t jsr = fnv1a(w, l);
+		uint32_t jcong = fnv1a(jsr, l);
+		kiss99 rng(z, w, jsr, jcong);
+		for(uint32_t& reg : mix[l])
+			reg = rng();
+	}
+
+	for(uint32_t r = 0; r < round_cnt; r++)
+		round(ctx, r, mix, lookup);
+
+	/* Reduce every lane to a word, then all lanes to 256 bits */
+	constexpr size_t num_words = sizeof(ethash::hash256) / sizeof(uint32_t);
+	ethash::hash256 mix_hash;
+	for(uint32_t& w : mix_hash.word32s)
+		w = fnv_offset_basis;
+	for(size_t l = 0; l < num_lanes; l++)
+	{
+		uint32_t lane_hash = fnv_offset_basis;
+		for(uint32_t i = 0; i < num_regs; i++)
+			lane_hash = fnv1a(lane_hash, mix[l][i]);
+		mix_hash.word32s[l % num_words] = fnv1a(mix_hash.word32s[l % num_words], lane_hash);
+	}
+	return mix_hash;
+}
+
+ethash::result pp_program::hash(const ethash::epoch_context& ctx, pp_item_cache* items, const ethash::hash256& header_hash, uint64_t nonce) const
+{
+	uint64_t seed = keccak_progpow_64(header_hash, nonce);
+	ethash::hash256 mix_hash;
+	if(items != nullptr)
+	{
+		cached_lookup lookup = { ctx, *items, 0 };
+		mix_hash = hash_mix(ctx, seed, lookup);
+		stats::inst().pp_item_hits.inc(lookup.hits);
+		stats::inst().pp_item_lookups.inc(round_cnt);
+	}
+	else
+	{
+		light_lookup lookup = { ctx };
+		mix_hash = hash_mix(ctx, seed, lookup);
+	}
+	return { keccak_progpow_256(header_hash, seed, mix_hash), mix_hash };
+}
+
+ethash::result pp_program::hash(const ethash::epoch_context_full& ctx, const ethash::hash256& header_hash, uint64_t nonce) const
+{
+	uint64_t seed = keccak_progpow_64(header_hash, nonce);
+	full_lookup lookup = { ctx };
+	ethash::hash256 mix_hash = hash_mix(ctx, seed, lookup);
+	return { keccak_progpow_256(header_hash, seed, mix_hash), mix_hash };
+}
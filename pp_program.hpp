@@ -0,0 +1,99 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "ethash/progpow.hpp"
+#include "ethash/ethash-internal.hpp"
+#include "pp_item_cache.hpp"
+
+/*
+ * The random part of ProgPoW, decoded once per period. Every round of every hash in a
+ * period runs the same sequence of cache reads, math and merges, only the mix data
+ * differs, so the kiss99 draws and selector decoding are done here instead of per hash.
+ * hash() is a drop-in for progpow::hash and gives the same result. pp_hashpool
+ * checks that against the library with fixed vectors before the first dataset is
+ * ready, on the first share of every period and on a sample of shares after that.
+ */
+class pp_program
+{
+public:
+	explicit pp_program(uint64_t period);
+
+	inline uint64_t get_period() const { return period; }
+
+	// Light mode, DAG items go through items if it is not null
+	ethash::result hash(const ethash::epoch_context& ctx, pp_item_cache* items, const ethash::hash256& header_hash, uint64_t nonce) const;
+	ethash::result hash(const ethash::epoch_context_full& ctx, const ethash::hash256& header_hash, uint64_t nonce) const;
+
+private:
+	constexpr static uint32_t round_cnt = 64; // One DAG item per round
+	constexpr static size_t words_per_lane = sizeof(ethash::hash2048) / (sizeof(uint32_t) * progpow::num_lanes);
+	constexpr static int max_operations = progpow::num_cache_accesses > progpow::num_math_operations ?
+		progpow::num_cache_accesses : progpow::num_math_operations;
+
+	// random_merge decoded: (a * 33) + b, (a ^ b) * 33, rotl(a, rot) ^ b, rotr(a, rot) ^ b
+	struct merge_op
+	{
+		uint32_t kind;
+		uint32_t rot;
+	};
+
+	struct cache_op
+	{
+		uint32_t src;
+		uint32_t dst;
+		merge_op merge;
+	};
+
+	struct math_op
+	{
+		uint32_t src1;
+		uint32_t src2;
+		uint32_t kind; // random_math selector % 11
+		uint32_t dst;
+		merge_op merge;
+	};
+
+	typedef uint32_t mix_array[progpow::num_lanes][progpow::num_regs];
+
+	static merge_op decode_merge(uint32_t sel);
+
+	// lookup_t maps an item index to its hash2048, see the lookups in pp_program.cpp
+	template<typename lookup_t>
+	ethash::hash256 hash_mix(const ethash::epoch_context& ctx, uint64_t seed, lookup_t& lookup) const;
+	template<typename lookup_t>
+	void round(const ethash::epoch_context& ctx, uint32_t r, mix_array& mix, lookup_t& lookup) const;
+
+	uint64_t period;
+	cache_op cache_ops[progpow::num_cache_accesses];
+	math_op math_ops[progpow::num_math_operations];
+	uint32_t dag_dsts[words_per_lane];
+	merge_op dag_merges[words_per_lane];
+};
@@ -27,9 +27,20 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "randomx.h"
+#include "dataset.hpp"
+#include "blake2_generator.hpp"
+#include "superscalar.hpp"
+#include "reciprocal.h"
+#include "blake2/blake2.h"
 #include "rx_hashpool.hpp"
-#include <shared_mutex>
+#include "dataset_cache.hpp"
+#include "cpu_affinity.hpp"
+#include "hugepage_alloc.hpp"
+#include "stats.hpp"
+#include "time.hpp"
+#include <algorithm>
 #include <string.h>
+#include <type_traits>
 
 #include <cpuid.h>
 
@@ -40,69 +51,450 @@ inline bool has_hardware_aes()
 	return (cpu_info[2] & (1 << 25)) != 0;
 }
 
-rx_hashpool::rx_hashpool() : ds_ctr(0)
+// Shared memory is unmapped by shm_dataset, not by RandomX
+static void shm_dataset_dealloc(randomx_dataset*)
 {
-	threads.reserve(hash_thd_count);
-	for(size_t i = 0; i < hash_thd_count; i++)
-		threads.emplace_back(&rx_hashpool::hash_thd_main, this);
 }
 
-void rx_hashpool::hash_thd_main()
+static void hp_dataset_dealloc(randomx_dataset* dataset)
 {
+	hp_free(dataset->memory);
+}
+
+/*
+ * The cache comes from the library for its JIT and programs, but its memory is swapped
+ * for one from the huge page layer, or left empty when shared memory is attached per seed
+ * (see build_slot). The default allocation is never touched, so handing it straight back
+ * costs nothing.
+ */
+static randomx_cache* alloc_cache(bool shared)
+{
+	randomx_cache* ch = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_JIT));
+	uint8_t* mem = shared ? nullptr : static_cast<uint8_t*>(hp_alloc(randomx::CacheSize, "RandomX cache"));
+	if(ch == nullptr || (mem == nullptr && !shared))
+	{
+		logger::inst().err("Failed to allocate RandomX cache (not enough RAM).");
+		exit(1);
+	}
+
+	randomx::DefaultAllocator::freeMemory(ch->memory, randomx::CacheSize);
+	ch->memory = mem;
+	return ch;
+}
+
+static void release_cache(randomx_cache* ch)
+{
+	hp_free(ch->memory);
+	ch->memory = nullptr;
+	randomx_release_cache(ch);
+}
+
+/* The light cache import below works on these randomx_cache internals, a change to them has to fail the build */
+static_assert(std::is_same<decltype(randomx_cache::memory), uint8_t*>::value, "randomx_cache::memory changed");
+static_assert(std::is_same<decltype(randomx_cache::reciprocalCache), std::vector<uint64_t>>::value, "randomx_cache::reciprocalCache changed");
+static_assert(std::is_same<decltype(randomx_cache::cacheKey), std::string>::value, "randomx_cache::cacheKey changed");
+static_assert(sizeof(randomx_cache::programs) / sizeof(randomx_cache::programs[0]) >= RANDOMX_CACHE_ACCESSES, "randomx_cache::programs changed");
+
+/*
+ * Key for the disk cache files. RANDOMX_SRC_ID is a hash of the RandomX sources, set by CMake,
+ * so a submodule bump makes every file from the old sources fail the key check.
+ */
+static v32 cache_file_key(const v32& seed)
+{
+	v32 key;
+	blake2b(key.data, sizeof(key.data), RANDOMX_SRC_ID, strlen(RANDOMX_SRC_ID), seed.data, sizeof(seed.data));
+	return key;
+}
+
+/*
+ * Hash of a fixed input on a light VM. Taken from a cache the library built, it is stored with
+ * the cache file, and an imported cache has to give the same hash before anything uses it.
+ */
+static bool cache_fingerprint(randomx_cache* ch, v32& out)
+{
+	static const char input[] = "epic_poold light cache check";
 	int fl = RANDOMX_FLAG_JIT;
 	if(has_hardware_aes())
 		fl |= RANDOMX_FLAG_HARD_AES;
 
-	randomx_vm* v = randomx_create_vm((randomx_flags)fl, ds[0].ch, nullptr);
-	while(true)
-	{
-		rx_check_job* job = jobs.pop();
+	randomx_vm* vm = randomx_create_vm((randomx_flags)fl, ch, nullptr);
+	if(vm == nullptr)
+		return false;
+	randomx_calculate_hash(vm, input, sizeof(input) - 1, out.data);
+	randomx_destroy_vm(vm);
+	return true;
+}
 
-		size_t dsidx;
-		for(dsidx = 0; dsidx < ds.size(); dsidx++)
+/*
+ * What randomx_init_cache derives from the key besides the memory, generated the way the
+ * library's initCache does. Light VMs compile their code from the programs when the cache
+ * is set. The key stays empty, so a later randomx_init_cache still does the whole init.
+ */
+static void init_cache_programs(randomx_cache* ch, const v32& seed)
+{
+	ch->cacheKey.clear();
+	ch->reciprocalCache.clear();
+	randomx::Blake2Generator gen(static_cast<const uint8_t*>(seed), seed.size);
+	for(int i = 0; i < RANDOMX_CACHE_ACCESSES; i++)
+	{
+		randomx::generateSuperscalar(ch->programs[i], gen);
+		for(unsigned j = 0; j < ch->programs[i].getSize(); j++)
 		{
-			if(ds[dsidx].ready_seed_id == job->dataset_id)
-				break;
+			randomx::Instruction& instr = ch->programs[i](j);
+			if((randomx::SuperscalarInstructionType)instr.opcode == randomx::SuperscalarInstructionType::IMUL_RCP)
+			{
+				uint64_t rcp = randomx_reciprocal(instr.getImm32());
+				instr.setImm64(ch->reciprocalCache.size());
+				ch->reciprocalCache.push_back(rcp);
+			}
 		}
+	}
+}
 
-		if(dsidx == ds.size())
-		{
-			logger::inst().warn("Precalculated dataset for a job was not found! We lost a share!");
-			job->hash.set_all_ones();
-			job->error = true;
-			job->ready.set_value();
-			continue;
-		}
+static randomx_dataset* alloc_dataset()
+{
+	size_t dataset_len = size_t(randomx_dataset_item_count()) * RANDOMX_DATASET_ITEM_SIZE;
+	uint8_t* mem = static_cast<uint8_t*>(hp_alloc(dataset_len, "RandomX dataset"));
+	if(mem == nullptr)
+	{
+		logger::inst().err("Failed to allocate RandomX dataset (not enough RAM).");
+		exit(1);
+	}
+
+	randomx_dataset* dataset = new randomx_dataset();
+	dataset->memory = mem;
+	dataset->dealloc = &hp_dataset_dealloc;
+	return dataset;
+}
+
+void rx_dataset::alloc()
+{
+	if(ch != nullptr)
+		return;
+
+	size_t replica_cnt = get_replica_count();
+	bool full = jconf::inst().get_randomx_full_dataset();
+	ch = alloc_cache(!full && jconf::inst().get_dataset_shared_memory());
 
-		rx_dataset& nds = ds[dsidx];
-		std::shared_lock<std::shared_timed_mutex> lk(nds.mtx);
-		if(nds.ready_seed_id != job->dataset_id)
+	if(!full)
+	{
+		for(size_t i = 1; i < replica_cnt; i++)
+			node_ch.push_back(alloc_cache(false));
+		return;
+	}
+
+	if(jconf::inst().get_dataset_shared_memory())
+	{
+		/* Memory gets attached per seed, see build_slot */
+		dataset = new randomx_dataset();
+		dataset->dealloc = &shm_dataset_dealloc;
+		return;
+	}
+
+	dataset = alloc_dataset();
+	for(size_t i = 1; i < replica_cnt; i++)
+		node_dataset.push_back(alloc_dataset());
+}
+
+void rx_dataset::free()
+{
+	for(randomx_dataset* nd : node_dataset)
+		randomx_release_dataset(nd);
+	for(randomx_cache* nc : node_ch)
+		release_cache(nc);
+	node_dataset.clear();
+	node_ch.clear();
+
+	/* In light mode shm backs the cache, its memory goes with the detach */
+	if(dataset == nullptr && ch != nullptr && shm.attached())
+		ch->memory = nullptr;
+
+	if(dataset != nullptr)
+		randomx_release_dataset(dataset);
+	if(ch != nullptr)
+		release_cache(ch);
+	dataset = nullptr;
+	ch = nullptr;
+	shm.detach();
+}
+
+rx_hashpool::rx_hashpool() : shared_mem(jconf::inst().get_dataset_shared_memory()), ds(jconf::inst().get_dataset_slots()),
+	thd_cnt(jconf::inst().get_verify_thread_count()), thd_ctxs(new thd_ctx[thd_cnt])
+{
+	for(size_t i = 0; i < thd_cnt; i++)
+	{
+		thd_ctxs[i].replica = get_verify_thread_replica(i);
+		thd_ctxs[i].vms.assign(ds.size(), nullptr);
+		thd_ctxs[i].vm_gens.assign(ds.size(), 0);
+	}
+}
+
+bool rx_hashpool::release_engine()
+{
+	if(!ds.release_all())
+		return false;
+
+	for(size_t i = 0; i < thd_cnt; i++)
+		thd_ctxs[i].release_vms();
+	for(size_t i = 0; i < ds.size(); i++)
+		ds[i].free();
+
+	logger::inst().info("RandomX engine idle, datasets and VMs released.");
+	return true;
+}
+
+/* Called with a reference on the slot and the slot ready */
+randomx_vm* rx_hashpool::get_vm(thd_ctx& ctx, size_t ds_idx)
+{
+	rx_dataset& nds = ds[ds_idx];
+	randomx_cache* ch = nds.get_cache(ctx.replica);
+	randomx_dataset* dataset = nds.dataset != nullptr ? nds.get_dataset(ctx.replica) : nullptr;
+	randomx_vm*& vm = ctx.vms[ds_idx];
+	uint64_t& vm_gen = ctx.vm_gens[ds_idx];
+	uint64_t ready_gen = ds.get_ready_gen(ds_idx);
+
+	if(vm_gen == ready_gen)
+		return vm;
+
+	if(vm == nullptr)
+	{
+		int fl = RANDOMX_FLAG_JIT;
+		if(has_hardware_aes())
+			fl |= RANDOMX_FLAG_HARD_AES;
+
+		if(dataset != nullptr)
+			vm = randomx_create_vm((randomx_flags)(fl | RANDOMX_FLAG_FULL_MEM), nullptr, dataset);
+		else
+			vm = randomx_create_vm((randomx_flags)fl, ch, nullptr);
+	}
+	else
+	{
+		if(dataset != nullptr)
+			randomx_vm_set_dataset(vm, dataset);
+		else
+			randomx_vm_set_cache(vm, ch);
+		stats::inst().rx_vm_rebinds.inc();
+	}
+
+	vm_gen = ready_gen;
+	return vm;
+}
+
+void rx_hashpool::hash(size_t thd_idx, check_job** jobs, size_t cnt)
+{
+	thd_ctx& ctx = thd_ctxs[thd_idx];
+	uint64_t dataset_id = jobs[0]->dataset_id;
+	size_t dsidx = jobs[0]->dataset_slot;
+
+	/* verify_pool parks jobs until their slot is ready, blocking here would stall a shared worker */
+	if(!ds.is_slot_ready(dsidx))
+	{
+		logger::inst().err("RandomX job reached a worker before its dataset was ready.");
+		for(size_t i = 0; i < cnt; i++)
 		{
-			logger::inst().warn("Precalculated dataset was swapped out before we locked. We lost a share!");
-			job->hash.set_all_ones();
-			job->error = true;
-			job->ready.set_value();
-			continue;
+			jobs[i]->hash.set_all_ones();
+			jobs[i]->error = true;
 		}
+		return;
+	}
 
-		randomx_vm_set_cache(v, nds.ch);
-		randomx_calculate_hash(v, job->data, job->data_len, static_cast<uint8_t*>(job->hash));
+	randomx_vm* vm = get_vm(ctx, dsidx);
+	if(cnt == 1)
+	{
+		randomx_calculate_hash(vm, jobs[0]->data, jobs[0]->data_len, static_cast<uint8_t*>(jobs[0]->hash));
+	}
+	else
+	{
+		/* Program generation for the next input overlaps execution of the current one */
+		randomx_calculate_hash_first(vm, jobs[0]->data, jobs[0]->data_len);
+		for(size_t i = 1; i < cnt; i++)
+			randomx_calculate_hash_next(vm, jobs[i]->data, jobs[i]->data_len, static_cast<uint8_t*>(jobs[i-1]->hash));
+		randomx_calculate_hash_last(vm, static_cast<uint8_t*>(jobs[cnt-1]->hash));
+	}
 
-		logger::inst().dbglo("Dataset id: ", nds.ready_seed_id.load(), "\nhash: ", job->hash);
+	for(size_t i = 0; i < cnt; i++)
+	{
+		check_job* job = jobs[i];
+		logger::inst().dbglo("Dataset id: ", dataset_id, "\nhash: ", job->hash);
 
 		char blob[1024];
 		bin2hex((uint8_t*)job->data, job->data_len, blob);
 		logger::inst().dbglo("blob len: ", job->data_len, " blob: ", blob);
 
 		job->error = false;
-		job->ready.set_value();
 	}
 }
 
-void rx_hashpool::dataset_thd_main(size_t ds_idx)
+/* Fills the full dataset at mem, from the disk cache if possible. Returns true if it had to be calculated */
+bool rx_hashpool::build_dataset(rx_dataset& nds, uint8_t* mem, size_t len)
 {
-	rx_dataset& nds = ds[ds_idx];
-	std::lock_guard<std::shared_timed_mutex> lk(nds.mtx);
+	/* Fast mode VMs only read the dataset, so a cached copy saves building the cache too */
+	if(dataset_cache::inst().load(cache_kind::randomx, nds.ds_seed.get_id(), cache_file_key(nds.ds_seed), mem, len))
+		return false;
+
 	randomx_init_cache(nds.ch, static_cast<const uint8_t*>(nds.ds_seed), nds.ds_seed.size);
-	nds.ready_seed_id = nds.ds_seed.get_id();
+	init_dataset_mt(nds);
+	return true;
+}
+
+/* Fills the light mode cache, from the disk cache if possible. Returns true if it had to be calculated */
+bool rx_hashpool::build_cache(rx_dataset& nds)
+{
+	/* A failed load leaves junk in the memory, so the library must not think the key is already done */
+	nds.ch->cacheKey.clear();
+	v32 tag;
+	if(dataset_cache::inst().load(cache_kind::randomx_light, nds.ds_seed.get_id(), cache_file_key(nds.ds_seed), nds.ch->memory,
+		randomx::CacheSize, &tag))
+	{
+		init_cache_programs(nds.ch, nds.ds_seed);
+
+		v32 check;
+		if(cache_fingerprint(nds.ch, check) && check == tag)
+			return false;
+		logger::inst().warn("RandomX cache from disk doesn't hash like the one it was stored from, rebuilding it.");
+	}
+
+	randomx_init_cache(nds.ch, static_cast<const uint8_t*>(nds.ds_seed), nds.ds_seed.size);
+	return true;
+}
+
+/*
+ * Light mode cache from shared memory, built by whoever needs it first. The programs live in
+ * each process, so an attached cache only has them generated. Returns true if it was calculated.
+ */
+bool rx_hashpool::attach_shared_cache(rx_dataset& nds)
+{
+	bool built = false;
+	bool calculated = false;
+	uint8_t* mem = nds.shm.attach(cache_kind::randomx_light, nds.ds_seed.get_id(), randomx::CacheSize, [&](uint8_t* mem) {
+		nds.ch->memory = mem;
+		calculated = build_cache(nds);
+		built = true;
+	});
+
+	if(mem == nullptr)
+	{
+		logger::inst().err("Failed to attach shared RandomX cache.");
+		exit(1);
+	}
+
+	nds.ch->memory = mem;
+	if(!built)
+		init_cache_programs(nds.ch, nds.ds_seed);
+	return calculated;
+}
+
+/* Writes what the slot calculated to the disk cache, with a reference held so the slot isn't recycled under us */
+void rx_hashpool::store_slot(size_t ds_idx, cache_kind kind, const uint8_t* data, size_t len, const v32* tag)
+{
+	rx_dataset& nds = ds[ds_idx];
+	uint64_t seed_id = nds.ds_seed.get_id();
+	size_t idx = ds.acquire(seed_id);
+	if(idx == ds_idx)
+		dataset_cache::inst().store(kind, seed_id, cache_file_key(nds.ds_seed), data, len, tag);
+	if(idx != ds.npos)
+		ds.release(idx);
+}
+
+void rx_hashpool::build_slot(size_t ds_idx)
+{
+	rx_dataset& nds = ds[ds_idx];
+	uint64_t seed_id = nds.ds_seed.get_id();
+	nds.alloc();
+
+	if(nds.dataset == nullptr)
+	{
+		bool calculated = shared_mem ? attach_shared_cache(nds) : build_cache(nds);
+		v32 tag;
+		bool store = calculated && dataset_cache::inst().enabled() && cache_fingerprint(nds.ch, tag);
+		if(get_replica_count() > 1)
+			replicate_dataset(nds);
+		ds.set_ready(ds_idx);
+		dataset_builder::inst().notify_ready(cache_kind::randomx, seed_id);
+
+		if(store)
+			store_slot(ds_idx, cache_kind::randomx_light, nds.ch->memory, randomx::CacheSize, &tag);
+		return;
+	}
+
+	size_t dataset_len = size_t(randomx_dataset_item_count()) * RANDOMX_DATASET_ITEM_SIZE;
+	bool calculated = false;
+	if(shared_mem)
+	{
+		uint8_t* mem = nds.shm.attach(cache_kind::randomx, seed_id, dataset_len, [&](uint8_t* mem) {
+			nds.dataset->memory = mem;
+			calculated = build_dataset(nds, mem, dataset_len);
+		});
+
+		if(mem == nullptr)
+		{
+			logger::inst().err("Failed to attach shared RandomX dataset.");
+			exit(1);
+		}
+		nds.dataset->memory = mem;
+	}
+	else
+		calculated = build_dataset(nds, static_cast<uint8_t*>(randomx_get_dataset_memory(nds.dataset)), dataset_len);
+
+	if(get_replica_count() > 1)
+		replicate_dataset(nds);
+	ds.set_ready(ds_idx);
+	dataset_builder::inst().notify_ready(cache_kind::randomx, seed_id);
+
+	if(calculated && dataset_cache::inst().enabled())
+		store_slot(ds_idx, cache_kind::randomx, static_cast<const uint8_t*>(randomx_get_dataset_memory(nds.dataset)), dataset_len);
+}
+
+/*
+ * Every NUMA node gets its own copy, filled by a thread running on that node. hp_alloc
+ * doesn't populate, so mbind places a copy before its first touch. Replica 0 was filled
+ * by the builder threads wherever they ran, so its pages are moved.
+ */
+void rx_hashpool::replicate_dataset(rx_dataset& nds)
+{
+	const std::vector<uint32_t>& nodes = get_replica_nodes();
+	size_t dataset_len = size_t(randomx_dataset_item_count()) * RANDOMX_DATASET_ITEM_SIZE;
+	uint64_t start_ms = get_timestamp_ms();
+
+	std::vector<std::thread> thds;
+	thds.reserve(nodes.size());
+	for(size_t r = 0; r < nodes.size(); r++)
+	{
+		thds.emplace_back([&nds, &nodes, r, dataset_len]() {
+			pin_current_thread_to_node(nodes[r]);
+			if(nds.dataset != nullptr)
+			{
+				uint8_t* mem = static_cast<uint8_t*>(randomx_get_dataset_memory(nds.get_dataset(r)));
+				bind_memory_to_node(mem, dataset_len, nodes[r]);
+				if(r > 0)
+					memcpy(mem, randomx_get_dataset_memory(nds.dataset), dataset_len);
+			}
+			else
+			{
+				randomx_cache* ch = nds.get_cache(r);
+				bind_memory_to_node(ch->memory, randomx::CacheSize, nodes[r]);
+				if(r > 0)
+				{
+					memcpy(ch->memory, nds.ch->memory, randomx::CacheSize);
+					init_cache_programs(ch, nds.ds_seed);
+				}
+			}
+		});
+	}
+
+	for(std::thread& thd : thds)
+		thd.join();
+
+	logger::inst().info("RandomX ", nds.dataset != nullptr ? "dataset" : "cache", " replicated to ", nodes.size(),
+		" NUMA nodes in ", size_t(get_timestamp_ms() - start_ms), " ms.");
+}
+
+void rx_hashpool::init_dataset_mt(rx_dataset& nds)
+{
+	uint64_t start_ms = get_timestamp_ms();
+	dataset_builder::inst().parallel_for("RandomX dataset", randomx_dataset_item_count(), [&nds](uint64_t first, uint64_t cnt) {
+		randomx_init_dataset(nds.dataset, nds.ch, first, cnt);
+	});
+
+	logger::inst().info("RandomX dataset ready in ", size_t(get_timestamp_ms() - start_ms), " ms.");
 }
@@ -27,76 +27,61 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
-#include <shared_mutex>
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
-#include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "randomx.h"
 #include "vector32.h"
-#include "thdq.hpp"
 #include "log.hpp"
+#include "jconf.hpp"
 #include "check_job.hpp"
-
-constexpr uint64_t invalid_id = uint64_t(-1);
-
+#include "dataset_slots.hpp"
+#include "dataset_builder.hpp"
+#include "shm_dataset.hpp"
+
+/*
+ * Memory is only allocated when the slot is first built (see alloc), so an engine that
+ * never sees a RandomX job costs nothing, and free gives it all back when it goes idle.
+ */
 struct rx_dataset
 {
-	rx_dataset() : loaded_seed_id(invalid_id), ready_seed_id(invalid_id)
-	{
-		ch = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_LARGE_PAGES | RANDOMX_FLAG_JIT));
-		if(ch == nullptr)
-		{
-			logger::inst().err("Failed to allocate RandomX cache with large pages. Enable large page support for faster hashing.");
-			ch = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_JIT));
-			if(ch == nullptr)
-			{
-				logger::inst().err("Failed to allocate RandomX cache (not enough RAM).");
-				exit(0);
-			}
-		}
-	}
+	rx_dataset() : ch(nullptr), dataset(nullptr) {}
+	~rx_dataset() { free(); }
+
+	void alloc();
+	void free();
 
 	rx_dataset(const rx_dataset& r) = delete;
 	rx_dataset& operator=(const rx_dataset& r) = delete;
 	rx_dataset(rx_dataset&& r) = delete;
 	rx_dataset& operator=(rx_dataset&& r) = delete;
-
-	~rx_dataset()
-	{
-		randomx_release_cache(ch);
-	}
 	
 	void init_cache()
 	{
 		randomx_init_cache(ch, static_cast<const uint8_t*>(ds_seed), 32);
 	}
 
-	/* 
-	 * loaded_seed_id - seed id calculating or ready (or zero)
-	 * ready_seed_id - seed id that is ready (or zero), set after calculation
-	 */
+	inline randomx_cache* get_cache(size_t replica) { return replica == 0 ? ch : node_ch[replica - 1]; }
+	inline randomx_dataset* get_dataset(size_t replica) { return replica == 0 ? dataset : node_dataset[replica - 1]; }
 
 	v32 ds_seed;
-	std::atomic<uint64_t> loaded_seed_id;
-	std::atomic<uint64_t> ready_seed_id;
-	std::shared_timed_mutex mtx;
 	randomx_cache* ch;
+	randomx_dataset* dataset; // Only in full dataset (fast) mode, otherwise nullptr
+	shm_dataset shm; // Backs dataset, or ch in light mode, when it is shared between processes
+
+	// NUMA copies of ch (light mode) or dataset (fast mode) for replica 1 and up
+	std::vector<randomx_cache*> node_ch;
+	std::vector<randomx_dataset*> node_dataset;
 };
 
 class rx_hashpool
 {
 public:
 	constexpr static size_t hash_len = 32;
-	constexpr static size_t hash_thd_count = 2;
-
-	struct rx_check_job : public check_job
-	{
-		std::promise<void> ready;
-		uint64_t dataset_id;
-	};
 
 	inline static rx_hashpool& inst()
 	{
@@ -104,38 +89,78 @@ public:
 		return inst;
 	};
 
-	inline void push_job(rx_check_job& job) { jobs.push(&job); }
+	// All jobs need to be for the same dataset, thd_idx is the verify_pool worker
+	void hash(size_t thd_idx, check_job** jobs, size_t cnt);
 
-	inline bool has_dataset(uint64_t ndl)
+	// Starts calculating the dataset unless it is already there, may evict the least recently used one
+	inline void need_dataset(const v32& dataset_seed)
 	{
-		for(rx_dataset& hay : ds)
-		{
-			if(ndl == hay.loaded_seed_id)
-				return true;
-		}
-		return false;
+		size_t i = ds.reserve(dataset_seed.get_id());
+		if(i == ds.npos)
+			return;
+		ds[i].ds_seed = dataset_seed;
+		dataset_builder::inst().submit(cache_kind::randomx, dataset_seed.get_id(), [this, i]() { build_slot(i); },
+			[this, i]() { ds.set_failed(i); });
 	}
 
-	inline void calculate_dataset(const v32& dataset_seed)
+	// True while the dataset can't be used yet, dataset_builder fires an event once it can
+	inline bool is_pending(uint64_t seed_id) { return ds.is_pending(seed_id); }
+
+	// Pins the job's dataset until release(), false if it was never requested
+	inline bool acquire(check_job& job)
 	{
-		size_t i = ds_ctr.fetch_add(1) % ds.size();
-		ds[i].ready_seed_id = invalid_id;
-		ds[i].ds_seed = dataset_seed;
-		ds[i].loaded_seed_id = dataset_seed.get_id();
-		std::thread thd(&rx_hashpool::dataset_thd_main, this, i);
-		thd.detach();
+		job.dataset_slot = ds.acquire(job.dataset_id);
+		return job.dataset_slot != ds.npos;
 	}
 
+	inline void release(check_job& job) { ds.release(job.dataset_slot); }
+	inline bool is_ready(check_job& job) { return ds.is_slot_ready(job.dataset_slot); }
+	inline bool is_failed(check_job& job) { return ds.is_slot_failed(job.dataset_slot); }
+
+	// Frees every dataset and VM if nothing is in flight, false if there was nothing to free
+	bool release_engine();
+
 private:
-	rx_hashpool();
+	/*
+	 * Per verification thread state. Every dataset slot gets its own VM, bound when the
+	 * slot first becomes ready and re-bound only when the slot is rebuilt. Only touched
+	 * by its verify thread while it holds slot references, or by release_engine when
+	 * nothing is referenced.
+	 */
+	struct thd_ctx
+	{
+		thd_ctx() : replica(0) {}
+		~thd_ctx() { release_vms(); }
 
-	void dataset_thd_main(size_t ds_idx);
-	void hash_thd_main();
+		void release_vms()
+		{
+			for(randomx_vm*& vm : vms)
+			{
+				if(vm != nullptr)
+					randomx_destroy_vm(vm);
+				vm = nullptr;
+			}
+			std::fill(vm_gens.begin(), vm_gens.end(), 0);
+		}
 
-	std::array<rx_dataset, 2> ds;
-	std::atomic<size_t> ds_ctr;
+		size_t replica; // NUMA dataset replica this thread reads
+		std::vector<randomx_vm*> vms;
+		std::vector<uint64_t> vm_gens;
+	};
 
-	thdq<rx_check_job*> jobs;
-	std::vector<std::thread> threads;
-	
+	rx_hashpool();
+
+	void build_slot(size_t ds_idx);
+	void init_dataset_mt(rx_dataset& nds);
+	bool build_dataset(rx_dataset& nds, uint8_t* mem, size_t len);
+	bool build_cache(rx_dataset& nds);
+	bool attach_shared_cache(rx_dataset& nds);
+	void store_slot(size_t ds_idx, cache_kind kind, const uint8_t* data, size_t len, const v32* tag = nullptr);
+	void replicate_dataset(rx_dataset& nds);
+	randomx_vm* get_vm(thd_ctx& ctx, size_t ds_idx);
+
+	bool shared_mem;
+	dataset_slots<rx_dataset> ds;
+	size_t thd_cnt;
+	std::unique_ptr<thd_ctx[]> thd_ctxs;
 };
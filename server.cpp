@@ -29,6 +29,7 @@
 #include "socks.h"
 #include "server.hpp"
 #include "jconf.hpp"
+#include "stats.hpp"
 #include <assert.h>
 #include <netinet/tcp.h>
 
@@ -202,4 +203,5 @@ void server::notify_new_block()
 	}
 
 	logger::inst().info("Block refreshed!");
+	stats::inst().print();
 }
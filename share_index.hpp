@@ -0,0 +1,165 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <inttypes.h>
+#include <mutex>
+#include <vector>
+
+/*
+ * Set of extranonce+nonce keys submitted for one job, used to reject duplicate shares
+ * before they cost us a hash. Open addressing over plain uint64_t slots, split into
+ * shards so that client pools don't serialise on one lock. Lives as long as the job does.
+ */
+class share_index
+{
+public:
+	share_index() {}
+
+	share_index(const share_index& r) = delete;
+	share_index& operator=(const share_index& r) = delete;
+
+	// Returns false if the key was seen before
+	bool insert(uint64_t key)
+	{
+		uint64_t h = mix(key);
+		shard& sh = shards[h >> (64 - shard_bits)];
+		std::lock_guard<std::mutex> lk(sh.mtx);
+
+		/* Zero marks an empty slot, so the zero key is tracked on the side */
+		if(key == 0)
+		{
+			if(sh.has_zero)
+				return false;
+			sh.has_zero = true;
+			return true;
+		}
+
+		if((sh.used + 1) * 2 > sh.slots.size())
+			grow(sh);
+
+		size_t mask = sh.slots.size() - 1;
+		for(size_t i = h & mask; ; i = (i + 1) & mask)
+		{
+			if(sh.slots[i] == key)
+				return false;
+
+			if(sh.slots[i] == 0)
+			{
+				sh.slots[i] = key;
+				sh.used++;
+				return true;
+			}
+		}
+	}
+
+	// Forgets a key, for shares that were never checked after all
+	void erase(uint64_t key)
+	{
+		uint64_t h = mix(key);
+		shard& sh = shards[h >> (64 - shard_bits)];
+		std::lock_guard<std::mutex> lk(sh.mtx);
+
+		if(key == 0)
+		{
+			sh.has_zero = false;
+			return;
+		}
+
+		if(sh.slots.empty())
+			return;
+
+		size_t mask = sh.slots.size() - 1;
+		size_t i = h & mask;
+		while(sh.slots[i] != key)
+		{
+			if(sh.slots[i] == 0)
+				return;
+			i = (i + 1) & mask;
+		}
+
+		/* Backward shift, so that no probe chain gets cut by the hole */
+		for(size_t j = (i + 1) & mask; sh.slots[j] != 0; j = (j + 1) & mask)
+		{
+			size_t home = mix(sh.slots[j]) & mask;
+			bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+			if(!stays)
+			{
+				sh.slots[i] = sh.slots[j];
+				i = j;
+			}
+		}
+		sh.slots[i] = 0;
+		sh.used--;
+	}
+
+private:
+	constexpr static size_t shard_bits = 4;
+	constexpr static size_t shard_cnt = 1 << shard_bits;
+	constexpr static size_t initial_slots = 256;
+
+	struct shard
+	{
+		std::mutex mtx;
+		std::vector<uint64_t> slots;
+		size_t used = 0;
+		bool has_zero = false;
+	};
+
+	// splitmix64 finaliser
+	static inline uint64_t mix(uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebull;
+		x ^= x >> 31;
+		return x;
+	}
+
+	static void grow(shard& sh)
+	{
+		std::vector<uint64_t> old;
+		old.swap(sh.slots);
+		sh.slots.resize(old.empty() ? initial_slots : old.size() * 2, 0);
+
+		size_t mask = sh.slots.size() - 1;
+		for(uint64_t key : old)
+		{
+			if(key == 0)
+				continue;
+
+			size_t i = mix(key) & mask;
+			while(sh.slots[i] != 0)
+				i = (i + 1) & mask;
+			sh.slots[i] = key;
+		}
+	}
+
+	shard shards[shard_cnt];
+};
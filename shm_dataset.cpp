@@ -0,0 +1,291 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "shm_dataset.hpp"
+#include "log.hpp"
+#include "time.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+constexpr char shm_magic[8] = {'E', 'P', 'I', 'C', 'S', 'H', 'M', 0};
+constexpr uint32_t shm_version = 1;
+// Keeps the payload hugepage aligned, the header only needs a few bytes of it
+constexpr size_t shm_payload_offset = 2 * 1024 * 1024;
+
+struct shm_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t ready;
+	uint64_t payload_len;
+};
+
+inline int flock_retry(int fd, int op)
+{
+	int ret;
+	while((ret = flock(fd, op)) == -1 && errno == EINTR);
+	return ret;
+}
+
+/* First writable hugetlbfs mount, empty if there is none */
+static const std::string& hugetlbfs_dir()
+{
+	static const std::string dir = [] {
+		std::string ret;
+		FILE* mounts = setmntent("/proc/mounts", "r");
+		if(mounts == nullptr)
+			return ret;
+		while(struct mntent* ent = getmntent(mounts))
+		{
+			if(strcmp(ent->mnt_type, "hugetlbfs") == 0 && access(ent->mnt_dir, W_OK) == 0)
+			{
+				ret = ent->mnt_dir;
+				break;
+			}
+		}
+		endmntent(mounts);
+		return ret;
+	}();
+	return dir;
+}
+
+inline size_t round_up(size_t len, size_t page)
+{
+	return (len + page - 1) / page * page;
+}
+
+uint8_t* shm_dataset::attach_failed(const char* what)
+{
+	logger::inst().err("Shared dataset ", name.c_str(), ": ", what, " failed, ", strerror(errno));
+	if(map != nullptr)
+		munmap(map, map_len);
+	map = nullptr;
+	if(fd != -1)
+		close(fd);
+	fd = -1;
+	if(lock_fd != -1)
+		close(lock_fd); // Drops the name lock
+	lock_fd = -1;
+	return nullptr;
+}
+
+/*
+ * Takes the exclusive name lock. The last process to detach unlinks the lock object too, so one
+ * we opened before that happened is dead once we get it, and we try again with a fresh one.
+ */
+bool shm_dataset::lock_name()
+{
+	while(true)
+	{
+		lock_fd = shm_open((name + "_lock").c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if(lock_fd == -1)
+			return false;
+
+		struct stat sb;
+		if(flock_retry(lock_fd, LOCK_EX) == -1 || fstat(lock_fd, &sb) == -1)
+			return false;
+
+		if(sb.st_nlink > 0)
+			return true;
+
+		close(lock_fd);
+	}
+}
+
+/*
+ * Creates and maps the segment on hugetlbfs. The pages are reserved when mapping, so this
+ * fails cleanly if the pool is too small and the caller falls back to shared memory.
+ */
+bool shm_dataset::map_hugetlbfs(size_t len)
+{
+	fd = open(huge_path.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if(fd == -1)
+		return false;
+
+	struct statfs sfs;
+	if(fstatfs(fd, &sfs) == 0)
+	{
+		map_len = round_up(shm_payload_offset + len, size_t(sfs.f_bsize));
+		if(ftruncate(fd, map_len) == 0)
+		{
+			map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(map != MAP_FAILED)
+			{
+				hugetlb = true;
+				return true;
+			}
+		}
+	}
+
+	map = nullptr;
+	logger::inst().warn("Shared dataset ", name.c_str(), ": hugetlbfs failed (", strerror(errno), "), using transparent huge pages.");
+	unlink(huge_path.c_str());
+	close(fd);
+	fd = -1;
+	return false;
+}
+
+void shm_dataset::unlink_segment()
+{
+	if(hugetlb)
+		unlink(huge_path.c_str());
+	else
+		shm_unlink(name.c_str());
+}
+
+uint8_t* shm_dataset::attach(cache_kind kind, uint64_t id, size_t len, const std::function<void(uint8_t*)>& build)
+{
+	detach();
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "/epic_poold_v%u_%s%016" PRIx64, shm_version, cache_kind_prefix(kind), id);
+	name = buf;
+
+	huge_path = hugetlbfs_dir().empty() ? std::string() : hugetlbfs_dir() + name;
+	hugetlb = false;
+
+	if(!lock_name())
+		return attach_failed("locking the name");
+
+	/*
+	 * Under the name lock the segment can't be unlinked between here and our shared lock. An
+	 * existing segment is used wherever it lives, a new one goes on hugetlbfs if it fits.
+	 */
+	if(!huge_path.empty())
+	{
+		fd = open(huge_path.c_str(), O_RDWR);
+		hugetlb = fd != -1;
+	}
+	if(fd == -1)
+		fd = shm_open(name.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+
+	if(fd != -1)
+	{
+		struct stat sb;
+		if(fstat(fd, &sb) == -1)
+			return attach_failed("fstat");
+		map_len = size_t(sb.st_size);
+
+		/* A builder that died before sizing it, start over */
+		if(map_len < shm_payload_offset + len)
+		{
+			unlink_segment();
+			close(fd);
+			fd = -1;
+			hugetlb = false;
+		}
+	}
+
+	if(fd == -1 && (huge_path.empty() || !map_hugetlbfs(len)))
+	{
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if(fd == -1)
+			return attach_failed("shm_open");
+		map_len = shm_payload_offset + len;
+		if(ftruncate(fd, map_len) == -1)
+			return attach_failed("ftruncate");
+	}
+
+	if(map == nullptr)
+	{
+		map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(map == MAP_FAILED)
+		{
+			map = nullptr;
+			return attach_failed("mmap");
+		}
+	}
+
+	shm_header* hdr = static_cast<shm_header*>(map);
+	uint8_t* payload = static_cast<uint8_t*>(map) + shm_payload_offset;
+
+	bool ready = memcmp(hdr->magic, shm_magic, sizeof(shm_magic)) == 0 && hdr->version == shm_version &&
+		hdr->payload_len == len && hdr->ready == 1;
+
+	if(!ready)
+	{
+		uint64_t start_ms = get_timestamp_ms();
+		if(!hugetlb)
+			madvise(payload, len, MADV_HUGEPAGE);
+
+		hdr->ready = 0;
+		build(payload);
+
+		memcpy(hdr->magic, shm_magic, sizeof(shm_magic));
+		hdr->version = shm_version;
+		hdr->payload_len = len;
+		hdr->ready = 1;
+		logger::inst().info("Built shared dataset ", name.c_str(), " on ", hugetlb ? "hugetlbfs" : "shared memory", " in ",
+			size_t(get_timestamp_ms() - start_ms), " ms.");
+	}
+	else
+		logger::inst().info("Attached to shared dataset ", name.c_str(), " built by another process.");
+
+	if(mprotect(map, map_len, PROT_READ) == -1)
+		return attach_failed("mprotect");
+
+	if(flock_retry(fd, LOCK_SH) == -1)
+		return attach_failed("flock");
+
+	flock_retry(lock_fd, LOCK_UN);
+	return payload;
+}
+
+void shm_dataset::detach()
+{
+	if(fd == -1)
+		return;
+
+	if(map != nullptr)
+		munmap(map, map_len);
+
+	/*
+	 * Upgrading only succeeds if no other process holds the segment, then it's ours to remove.
+	 * The name lock keeps attachers out while we decide, none can sit between opening and LOCK_SH.
+	 * Anyone already waiting on the lock object sees it unlinked and opens a new one.
+	 */
+	if(flock_retry(lock_fd, LOCK_EX) == 0 && flock(fd, LOCK_EX | LOCK_NB) == 0)
+	{
+		unlink_segment();
+		shm_unlink((name + "_lock").c_str());
+	}
+
+	close(fd);
+	close(lock_fd);
+	fd = -1;
+	lock_fd = -1;
+	map = nullptr;
+}
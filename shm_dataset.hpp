@@ -0,0 +1,78 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <functional>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string>
+
+#include "dataset_cache.hpp"
+
+/*
+ * Dataset memory shared by every epic_poold on the host through a named segment, a file on
+ * the first hugetlbfs mount if there is one with enough free pages, a POSIX shared memory
+ * object with transparent huge pages otherwise. Opening, building and removing the segment
+ * happen under an exclusive flock on a separate, empty "<name>_lock" object, so nobody can
+ * open a segment that is being unlinked. The first process to take that lock builds, the
+ * rest block on it and then map the result. A builder that dies drops the lock, so the
+ * next process in line simply builds again. Attached processes hold a shared lock on the
+ * segment itself, the last one to detach removes the segment and the lock object.
+ */
+class shm_dataset
+{
+public:
+	shm_dataset() : lock_fd(-1), fd(-1), hugetlb(false), map(nullptr), map_len(0) {}
+	~shm_dataset() { detach(); }
+
+	shm_dataset(const shm_dataset& r) = delete;
+	shm_dataset& operator=(const shm_dataset& r) = delete;
+
+	/*
+	 * Returns the payload of the segment for kind/id, mapped read-only, or nullptr on error.
+	 * If nobody built it yet, build is called first with the payload still writable.
+	 */
+	uint8_t* attach(cache_kind kind, uint64_t id, size_t len, const std::function<void(uint8_t*)>& build);
+	void detach();
+
+	inline bool attached() const { return map != nullptr; }
+
+private:
+	uint8_t* attach_failed(const char* what);
+	bool lock_name();
+	bool map_hugetlbfs(size_t len);
+	void unlink_segment();
+
+	std::string name;
+	std::string huge_path; // Segment file on hugetlbfs, empty if there is no mount
+	int lock_fd;
+	int fd;
+	bool hugetlb;
+	void* map;
+	size_t map_len;
+};
@@ -0,0 +1,59 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "stats.hpp"
+#include "log.hpp"
+
+void stats::print()
+{
+	std::lock_guard<std::mutex> lk(print_mtx);
+	uint64_t events;
+	uint64_t avg_us;
+
+	avg_us = queue_wait.take_avg_us(events);
+	logger::inst().info("STATS Verify queue wait: ", size_t(avg_us), " us avg over ", size_t(events), " shares");
+	avg_us = prio_wait.take_avg_us(events);
+	logger::inst().info("STATS Priority lane wait: ", size_t(avg_us), " us avg over ", size_t(events), " block candidates");
+
+	logger::inst().info("STATS RandomX VM rebinds: ", size_t(rx_vm_rebinds.take_delta()), " (total ", size_t(rx_vm_rebinds.get()), ")");
+	logger::inst().info("STATS Duplicate shares rejected: ", size_t(dup_shares.take_delta()), " (total ", size_t(dup_shares.get()), ")");
+	logger::inst().info("STATS False block claims: ", size_t(false_block_claims.take_delta()), " (total ", size_t(false_block_claims.get()), ")");
+	uint64_t replies = net_replies.take_delta();
+	uint64_t writes = net_writes.take_delta();
+	if(writes > 0)
+		logger::inst().info("STATS Miner messages: ", size_t(replies), " in ", size_t(writes), " writes");
+	logger::inst().info("STATS Clients dropped on send queue limit: ", size_t(send_hwm_drops.take_delta()), " (total ", size_t(send_hwm_drops.get()), ")");
+	logger::inst().info("STATS ProgPoW resident dataset memory: ", size_t(pp_dataset_bytes.get() >> 20), " MiB");
+	uint64_t lookups = pp_item_lookups.take_delta();
+	uint64_t hits = pp_item_hits.take_delta();
+	if(lookups > 0)
+		logger::inst().info("STATS ProgPoW item cache hit rate: ", size_t(hits * 100 / lookups), "% of ", size_t(lookups), " lookups");
+	logger::inst().info("STATS Large allocations: 1G pages ", size_t(mem_huge_1g_bytes.get() >> 20), " MiB, 2M pages ",
+		size_t(mem_huge_2m_bytes.get() >> 20), " MiB, THP ", size_t(mem_thp_bytes.get() >> 20), " MiB, normal ",
+		size_t(mem_normal_bytes.get() >> 20), " MiB");
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <inttypes.h>
+
+/* Monotonic counter, the logger prints the total and the change since the last print */
+struct stat_counter
+{
+	stat_counter() : total(0), last_print(0) {}
+
+	inline void inc(uint64_t v = 1) { total.fetch_add(v, std::memory_order_relaxed); }
+
+	inline uint64_t get() const { return total.load(std::memory_order_relaxed); }
+
+	inline uint64_t take_delta()
+	{
+		uint64_t now = get();
+		uint64_t delta = now - last_print;
+		last_print = now;
+		return delta;
+	}
+
+	std::atomic<uint64_t> total;
+	uint64_t last_print; // Only touched under stats::print_mtx
+};
+
+/* Current value, for example bytes in use */
+struct stat_gauge
+{
+	stat_gauge() : val(0) {}
+
+	inline void add(uint64_t v) { val.fetch_add(v, std::memory_order_relaxed); }
+	inline void sub(uint64_t v) { val.fetch_sub(v, std::memory_order_relaxed); }
+	inline uint64_t get() const { return val.load(std::memory_order_relaxed); }
+
+	std::atomic<uint64_t> val;
+};
+
+/* Accumulated time over a number of events, printed as the average since the last print */
+struct stat_timer
+{
+	stat_timer() : cnt(0), sum_us(0), last_cnt(0), last_sum_us(0) {}
+
+	inline void add(uint64_t us)
+	{
+		cnt.fetch_add(1, std::memory_order_relaxed);
+		sum_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	inline uint64_t take_avg_us(uint64_t& events)
+	{
+		uint64_t now_cnt = cnt.load(std::memory_order_relaxed);
+		uint64_t now_sum = sum_us.load(std::memory_order_relaxed);
+		events = now_cnt - last_cnt;
+		uint64_t avg = events > 0 ? (now_sum - last_sum_us) / events : 0;
+		last_cnt = now_cnt;
+		last_sum_us = now_sum;
+		return avg;
+	}
+
+	std::atomic<uint64_t> cnt;
+	std::atomic<uint64_t> sum_us;
+	uint64_t last_cnt; // Only touched under stats::print_mtx
+	uint64_t last_sum_us;
+};
+
+class stats
+{
+public:
+	inline static stats& inst()
+	{
+		static stats inst;
+		return inst;
+	};
+
+	// Called on every new block, from the node thread or a dataset builder thread
+	void print();
+
+	stat_counter rx_vm_rebinds;
+	stat_counter dup_shares;
+	stat_counter false_block_claims; // Priority lane shares that weren't blocks
+	stat_counter send_hwm_drops; // Clients dropped with a full send queue
+	stat_counter net_replies; // Messages sent to miners
+	stat_counter net_writes; // write() calls it took
+	stat_gauge pp_dataset_bytes;
+	stat_counter pp_item_lookups; // Light mode DAG items through pp_item_cache
+	stat_counter pp_item_hits;
+	stat_gauge mem_huge_1g_bytes; // Mapped through hp_alloc, by page tier
+	stat_gauge mem_huge_2m_bytes;
+	stat_gauge mem_thp_bytes;
+	stat_gauge mem_normal_bytes;
+	stat_timer queue_wait;
+	stat_timer prio_wait;
+
+private:
+	stats() {}
+
+	std::mutex print_mtx; // Ready events print from builder threads too
+};
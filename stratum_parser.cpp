@@ -0,0 +1,408 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "stratum_parser.hpp"
+
+#include <string.h>
+
+namespace
+{
+/*
+ * Recursive descent over one line. Strings are unescaped in place the way rapidjson's
+ * insitu parsing does it, since an escape is never shorter than what it decodes to.
+ */
+class stratum_scanner
+{
+public:
+	stratum_scanner(char* line, stratum_request& req) : p(line), req(req) {}
+
+	bool parse()
+	{
+		skip_ws();
+		if(*p != '{' || !parse_object(field_set::top, 1))
+			return false;
+		skip_ws();
+		return *p == '\0';
+	}
+
+private:
+	constexpr static int max_depth = 32;
+
+	enum class field_set { top, params, none };
+	enum field { f_none, f_id, f_method, f_params, f_job_id, f_nonce, f_result };
+
+	char* p;
+	stratum_request& req;
+	uint32_t seen = 0;
+
+	inline static bool key_is(const json_str& key, const char* name, uint32_t len)
+	{
+		return key.len == len && memcmp(key.str, name, len) == 0;
+	}
+
+	field lookup(field_set set, const json_str& key)
+	{
+		field f = f_none;
+		if(set == field_set::top)
+		{
+			if(key_is(key, "id", 2))
+				f = f_id;
+			else if(key_is(key, "method", 6))
+				f = f_method;
+			else if(key_is(key, "params", 6))
+				f = f_params;
+		}
+		else if(set == field_set::params)
+		{
+			if(key_is(key, "job_id", 6))
+				f = f_job_id;
+			else if(key_is(key, "nonce", 5))
+				f = f_nonce;
+			else if(key_is(key, "result", 6))
+				f = f_result;
+		}
+
+		if(f == f_none || (seen & (1u << f)) != 0)
+			return f_none;
+		seen |= 1u << f;
+		return f;
+	}
+
+	inline void skip_ws()
+	{
+		while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+	}
+
+	bool parse_object(field_set set, int depth)
+	{
+		p++;
+		skip_ws();
+		if(*p == '}')
+		{
+			p++;
+			return true;
+		}
+
+		while(true)
+		{
+			json_str key;
+			if(*p != '"' || !parse_string(key))
+				return false;
+			skip_ws();
+			if(*p != ':')
+				return false;
+			p++;
+			skip_ws();
+
+			if(!parse_value(lookup(set, key), depth))
+				return false;
+
+			skip_ws();
+			if(*p == '}')
+			{
+				p++;
+				return true;
+			}
+			if(*p != ',')
+				return false;
+			p++;
+			skip_ws();
+		}
+	}
+
+	bool parse_array(int depth)
+	{
+		p++;
+		skip_ws();
+		if(*p == ']')
+		{
+			p++;
+			return true;
+		}
+
+		while(true)
+		{
+			if(!parse_value(f_none, depth))
+				return false;
+
+			skip_ws();
+			if(*p == ']')
+			{
+				p++;
+				return true;
+			}
+			if(*p != ',')
+				return false;
+			p++;
+			skip_ws();
+		}
+	}
+
+	bool parse_value(field f, int depth)
+	{
+		switch(*p)
+		{
+		case '{':
+			if(depth >= max_depth)
+				return false;
+			if(f == f_params)
+			{
+				req.has_params = true;
+				return parse_object(field_set::params, depth + 1);
+			}
+			return parse_object(field_set::none, depth + 1);
+		case '[':
+			if(depth >= max_depth)
+				return false;
+			return parse_array(depth + 1);
+		case '"':
+		{
+			json_str s;
+			if(!parse_string(s))
+				return false;
+			if(f == f_method)
+				req.method = s;
+			else if(f == f_job_id)
+				req.job_id = s;
+			else if(f == f_nonce)
+				req.nonce = s;
+			else if(f == f_result)
+				req.result = s;
+			return true;
+		}
+		case 't':
+			return parse_literal("true", 4);
+		case 'f':
+			return parse_literal("false", 5);
+		case 'n':
+			return parse_literal("null", 4);
+		default:
+			return parse_number(f == f_id);
+		}
+	}
+
+	inline bool parse_literal(const char* lit, size_t len)
+	{
+		if(strncmp(p, lit, len) != 0)
+			return false;
+		p += len;
+		return true;
+	}
+
+	static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+	bool parse_number(bool want_id)
+	{
+		bool neg = *p == '-';
+		if(neg)
+			p++;
+
+		if(!is_digit(*p))
+			return false;
+
+		/* Integer part, leading zeros are not JSON */
+		uint64_t v = 0;
+		bool overflow = false;
+		if(*p == '0')
+			p++;
+		else
+		{
+			while(is_digit(*p))
+			{
+				uint64_t d = *p - '0';
+				if(v > (UINT64_MAX - d) / 10)
+					overflow = true;
+				v = v * 10 + d;
+				p++;
+			}
+		}
+
+		bool integral = true;
+		if(*p == '.')
+		{
+			p++;
+			if(!is_digit(*p))
+				return false;
+			while(is_digit(*p))
+				p++;
+			integral = false;
+		}
+
+		if(*p == 'e' || *p == 'E')
+		{
+			p++;
+			if(*p == '+' || *p == '-')
+				p++;
+			if(!is_digit(*p))
+				return false;
+			while(is_digit(*p))
+				p++;
+			integral = false;
+		}
+
+		if(!want_id || !integral || overflow)
+			return true;
+
+		if(neg && v <= uint64_t(INT64_MAX) + 1)
+			req.call_id = int64_t(0 - v);
+		else if(!neg && v <= uint64_t(INT64_MAX))
+			req.call_id = int64_t(v);
+		return true;
+	}
+
+	static inline int hex_val(char c)
+	{
+		if(c >= '0' && c <= '9')
+			return c - '0';
+		if(c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if(c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	bool parse_hex4(uint32_t& cp)
+	{
+		cp = 0;
+		for(int i = 0; i < 4; i++)
+		{
+			int v = hex_val(p[i]);
+			if(v < 0)
+				return false;
+			cp = (cp << 4) | v;
+		}
+		p += 4;
+		return true;
+	}
+
+	bool parse_string(json_str& out)
+	{
+		char* start = ++p;
+		char* w = p;
+		while(true)
+		{
+			char c = *p;
+			if(c == '"')
+				break;
+
+			if((unsigned char)c < 0x20)
+				return false; // Control character or end of line
+
+			p++;
+			if(c != '\\')
+			{
+				*w++ = c;
+				continue;
+			}
+
+			c = *p++;
+			switch(c)
+			{
+			case '"':
+			case '\\':
+			case '/':
+				*w++ = c;
+				break;
+			case 'b':
+				*w++ = '\b';
+				break;
+			case 'f':
+				*w++ = '\f';
+				break;
+			case 'n':
+				*w++ = '\n';
+				break;
+			case 'r':
+				*w++ = '\r';
+				break;
+			case 't':
+				*w++ = '\t';
+				break;
+			case 'u':
+			{
+				uint32_t cp;
+				if(!parse_hex4(cp))
+					return false;
+				if(cp >= 0xDC00 && cp <= 0xDFFF)
+					return false;
+				if(cp >= 0xD800 && cp <= 0xDBFF)
+				{
+					uint32_t lo;
+					if(p[0] != '\\' || p[1] != 'u')
+						return false;
+					p += 2;
+					if(!parse_hex4(lo) || lo < 0xDC00 || lo > 0xDFFF)
+						return false;
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+				}
+				w = put_utf8(w, cp);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+
+		*w = '\0';
+		p++;
+		out.str = start;
+		out.len = w - start;
+		return true;
+	}
+
+	static char* put_utf8(char* w, uint32_t cp)
+	{
+		if(cp < 0x80)
+			*w++ = cp;
+		else if(cp < 0x800)
+		{
+			*w++ = 0xC0 | (cp >> 6);
+			*w++ = 0x80 | (cp & 0x3F);
+		}
+		else if(cp < 0x10000)
+		{
+			*w++ = 0xE0 | (cp >> 12);
+			*w++ = 0x80 | ((cp >> 6) & 0x3F);
+			*w++ = 0x80 | (cp & 0x3F);
+		}
+		else
+		{
+			*w++ = 0xF0 | (cp >> 18);
+			*w++ = 0x80 | ((cp >> 12) & 0x3F);
+			*w++ = 0x80 | ((cp >> 6) & 0x3F);
+			*w++ = 0x80 | (cp & 0x3F);
+		}
+		return w;
+	}
+};
+}
+
+bool parse_stratum_request(char* line, stratum_request& req)
+{
+	return stratum_scanner(line, req).parse();
+}
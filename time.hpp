@@ -42,6 +42,12 @@ inline uint64_t get_timestamp_ms()
 	return time_point_cast<milliseconds>(steady_clock::now()).time_since_epoch().count();
 }
 
+inline uint64_t get_timestamp_us()
+{
+	using namespace std::chrono;
+	return time_point_cast<microseconds>(steady_clock::now()).time_since_epoch().count();
+}
+
 inline int64_t get_timestamp()
 {
 	using namespace std::chrono;
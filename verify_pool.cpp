@@ -0,0 +1,276 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "verify_pool.hpp"
+#include "cpu_affinity.hpp"
+#include "dataset_builder.hpp"
+#include "jconf.hpp"
+#include "pp_hashpool.hpp"
+#include "rx_hashpool.hpp"
+#include "stats.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+
+verify_pool::verify_pool() : worker_cnt(jconf::inst().get_verify_thread_count()),
+	workers(new worker[worker_cnt]), push_ctr(0), queued(0)
+{
+	print_numa_topology();
+
+	dataset_builder::inst().subscribe([this](cache_kind kind, uint64_t id, bool ok) { on_dataset_event(kind, id, ok); });
+
+	threads.reserve(worker_cnt);
+	for(size_t i = 0; i < worker_cnt; i++)
+	{
+		threads.emplace_back(&verify_pool::worker_main, this, i);
+		pin_verify_thread(threads.back(), i);
+	}
+}
+
+bool verify_pool::acquire_dataset(check_job& job)
+{
+	switch(job.type)
+	{
+	case pow_type::randomx:
+		return rx_hashpool::inst().acquire(job);
+	case pow_type::progpow:
+		return pp_hashpool::inst().acquire(job);
+	default:
+		return false;
+	}
+}
+
+void verify_pool::release_dataset(check_job& job)
+{
+	switch(job.type)
+	{
+	case pow_type::randomx:
+		rx_hashpool::inst().release(job);
+		break;
+	case pow_type::progpow:
+		pp_hashpool::inst().release(job);
+		break;
+	default:
+		break;
+	}
+}
+
+bool verify_pool::is_dataset_ready(check_job& job)
+{
+	switch(job.type)
+	{
+	case pow_type::randomx:
+		return rx_hashpool::inst().is_ready(job);
+	case pow_type::progpow:
+		return pp_hashpool::inst().is_ready(job);
+	default:
+		return true;
+	}
+}
+
+bool verify_pool::is_dataset_failed(check_job& job)
+{
+	switch(job.type)
+	{
+	case pow_type::randomx:
+		return rx_hashpool::inst().is_failed(job);
+	case pow_type::progpow:
+		return pp_hashpool::inst().is_failed(job);
+	default:
+		return false;
+	}
+}
+
+bool verify_pool::push_job(check_job& job)
+{
+	if(!acquire_dataset(job))
+		return false;
+
+	job.queued_us = get_timestamp_us();
+
+	/* Checked under the lock the dataset event takes, so a job can't be parked after its event */
+	std::unique_lock<std::mutex> plock(parked_mtx);
+	if(is_dataset_failed(job))
+	{
+		plock.unlock();
+		release_dataset(job);
+		return false;
+	}
+
+	if(!is_dataset_ready(job))
+	{
+		parked.push_back(&job);
+		return true;
+	}
+	plock.unlock();
+
+	enqueue(job);
+	return true;
+}
+
+/* Parked jobs go to the workers once their dataset is ready, or fail with it */
+void verify_pool::on_dataset_event(cache_kind kind, uint64_t id, bool ok)
+{
+	pow_type type = kind == cache_kind::randomx ? pow_type::randomx : pow_type::progpow;
+	std::vector<check_job*> ready;
+
+	std::unique_lock<std::mutex> plock(parked_mtx);
+	auto it = std::partition(parked.begin(), parked.end(), [type, id](check_job* job) {
+		return job->type != type || job->dataset_id != id;
+	});
+	ready.assign(it, parked.end());
+	parked.erase(it, parked.end());
+	plock.unlock();
+
+	for(check_job* job : ready)
+	{
+		if(ok)
+		{
+			enqueue(*job);
+			continue;
+		}
+
+		job->hash.set_all_ones();
+		job->error = true;
+		release_dataset(*job);
+		job->complete();
+	}
+}
+
+void verify_pool::enqueue(check_job& job)
+{
+	worker& w = job.priority ? prio : workers[push_ctr.fetch_add(1) % worker_cnt];
+	std::unique_lock<std::mutex> mlock(w.mtx);
+	w.jobs.push_back(&job);
+	mlock.unlock();
+
+	std::unique_lock<std::mutex> ilock(idle_mtx);
+	queued++;
+	ilock.unlock();
+	idle_cv.notify_one();
+}
+
+/*
+ * Takes the oldest job and, for RandomX, any jobs right behind it for the same dataset.
+ * The batch only grows when jobs are already waiting, so a lone share is never delayed.
+ */
+size_t verify_pool::try_pop(worker& w, check_job** out)
+{
+	std::unique_lock<std::mutex> mlock(w.mtx);
+	if(w.jobs.empty())
+		return 0;
+
+	size_t cnt = 0;
+	out[cnt++] = w.jobs.front();
+	w.jobs.pop_front();
+
+	if(out[0]->type == pow_type::randomx)
+	{
+		while(cnt < max_rx_batch && !w.jobs.empty() &&
+			w.jobs.front()->type == pow_type::randomx && w.jobs.front()->dataset_id == out[0]->dataset_id)
+		{
+			out[cnt++] = w.jobs.front();
+			w.jobs.pop_front();
+		}
+	}
+
+	queued -= cnt;
+	return cnt;
+}
+
+bool verify_pool::try_pop_prio(check_job** out)
+{
+	std::unique_lock<std::mutex> mlock(prio.mtx);
+	if(prio.jobs.empty())
+		return false;
+
+	out[0] = prio.jobs.front();
+	prio.jobs.pop_front();
+	queued--;
+	return true;
+}
+
+size_t verify_pool::pop_jobs(size_t idx, check_job** out)
+{
+	while(true)
+	{
+		if(try_pop_prio(out))
+			return 1;
+
+		/* Own deque first, then steal from the neighbours */
+		for(size_t i = 0; i < worker_cnt; i++)
+		{
+			size_t cnt = try_pop(workers[(idx + i) % worker_cnt], out);
+			if(cnt > 0)
+				return cnt;
+		}
+
+		std::unique_lock<std::mutex> mlock(idle_mtx);
+		idle_cv.wait(mlock, [this] { return queued > 0; });
+	}
+}
+
+void verify_pool::worker_main(size_t idx)
+{
+	size_t replica = get_verify_thread_replica(idx);
+	check_job* jobs[max_rx_batch];
+
+	while(true)
+	{
+		size_t cnt = pop_jobs(idx, jobs);
+
+		uint64_t now_us = get_timestamp_us();
+		for(size_t i = 0; i < cnt; i++)
+		{
+			stat_timer& wait = jobs[i]->priority ? stats::inst().prio_wait : stats::inst().queue_wait;
+			wait.add(now_us - jobs[i]->queued_us);
+		}
+
+		switch(jobs[0]->type)
+		{
+		case pow_type::randomx:
+			rx_hashpool::inst().hash(idx, jobs, cnt);
+			break;
+		case pow_type::progpow:
+			pp_hashpool::inst().hash(jobs[0], replica);
+			break;
+		default:
+			jobs[0]->hash.set_all_ones();
+			jobs[0]->error = true;
+			break;
+		}
+
+		for(size_t i = 0; i < cnt; i++)
+		{
+			release_dataset(*jobs[i]);
+			if(jobs[i]->on_verified != nullptr)
+				jobs[i]->on_verified(jobs[i]);
+			jobs[i]->complete();
+		}
+	}
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2014-2023, Epic Cash and fireice-uk
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "check_job.hpp"
+#include "dataset_cache.hpp"
+
+/*
+ * Verification threads shared by all PoW algorithms. Every worker has its own
+ * deque, pushes are spread round-robin and a worker that runs dry steals from
+ * the others, so all cores stay busy whatever algorithm mix the node sends us.
+ * Jobs for a dataset that is still being built are parked until its ready event,
+ * so no worker sits blocked on a build. If the build fails they complete with an error.
+ */
+class verify_pool
+{
+public:
+	inline static verify_pool& inst()
+	{
+		static verify_pool inst;
+		return inst;
+	};
+
+	// Takes a reference on the job's dataset, false if the dataset is unknown
+	bool push_job(check_job& job);
+
+private:
+	// Upper bound for RandomX jobs hashed back to back with calculate_hash_first/next
+	constexpr static size_t max_rx_batch = 8;
+
+	verify_pool();
+
+	struct worker
+	{
+		std::deque<check_job*> jobs;
+		std::mutex mtx;
+	};
+
+	void enqueue(check_job& job);
+	void on_dataset_event(cache_kind kind, uint64_t id, bool ok);
+	void worker_main(size_t idx);
+	size_t pop_jobs(size_t idx, check_job** out);
+	size_t try_pop(worker& w, check_job** out);
+	bool try_pop_prio(check_job** out);
+	static bool acquire_dataset(check_job& job);
+	static void release_dataset(check_job& job);
+	static bool is_dataset_ready(check_job& job);
+	static bool is_dataset_failed(check_job& job);
+
+	size_t worker_cnt;
+	std::unique_ptr<worker[]> workers;
+	std::atomic<size_t> push_ctr;
+
+	// Block candidates, every worker looks here before its own deque
+	worker prio;
+
+	// Can go transiently negative, a worker may take a job before the push is counted
+	std::atomic<int64_t> queued;
+	std::mutex idle_mtx;
+	std::condition_variable idle_cv;
+
+	// Jobs holding a reference on a slot that is still building
+	std::mutex parked_mtx;
+	std::vector<check_job*> parked;
+
+	std::vector<std::thread> threads;
+};
@@ -29,7 +29,9 @@
 #pragma once
 
 #include "vector32.h"
+#include "share_index.hpp"
 #include <inttypes.h>
+#include <memory>
 
 enum class pow_type : uint32_t
 {
@@ -51,6 +53,22 @@ inline const char* pow_type_to_str(pow_type type)
 	}
 }
 
+/*
+ * Job notification, serialized once per job by client::build_job_template. Clients copy
+ * it and patch their own hex fields in at the offsets, all of them 8 characters long.
+ * The params object is also the job object of the login reply.
+ */
+struct job_template
+{
+	char msg[1024];
+	size_t len;
+	size_t params_off;
+	size_t params_len;
+	size_t extra_nonce_off;
+	size_t jobid_off;
+	size_t target_off;
+};
+
 struct jobdata
 {
 	pow_type type;
@@ -61,6 +79,8 @@ struct jobdata
 	uint32_t prepow_len;
 	v32 rx_seed;
 	v32 rx_next_seed;
+	std::shared_ptr<share_index> shares; // Freed when the last client moves past this job
+	job_template notify;
 };
 
 typedef void (*on_new_job_callback)(const jobdata&);